@@ -17,8 +17,34 @@ end
 
 have_func('flite_voice_load')
 have_func('flite_add_lang')
+have_func('feat_link_into')
 have_struct_member('cst_audio_streaming_info', 'utt', 'flite/cst_audio.h')
 
+# for Flite::Voice#to_speech_io
+have_header('poll.h')
+have_header('fcntl.h')
+have_func('pwrite')
+have_func('rb_io_descriptor')
+
+# for the :parallel option of Flite::Voice#to_speech
+have_header('pthread.h')
+
+# for synthesis in non-blocking fibers
+if have_header('ruby/fiber/scheduler.h')
+  have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+end
+
+# for Ractors
+have_func('rb_ext_ractor_safe', 'ruby.h')
+
+# static probes for bpftrace, perf and SystemTap
+if with_config('usdt')
+  unless have_header('sys/sdt.h')
+    raise "--with-usdt requires sys/sdt.h. Install systemtap-sdt-dev or systemtap-sdt-devel."
+  end
+  $defs << "-DRBFLITE_USDT"
+end
+
 langs = with_config('langs', 'eng,indic,grapheme')
 
 langs.split(',').each do |lang|
@@ -111,6 +137,15 @@ end
 
 if have_library('mp3lame')
   have_header('lame.h') || have_header('lame/lame.h')
+  # for the pool of mp3 encoders
+  have_func('lame_init_bitstream')
+end
+
+# Ogg pages are written by rbflite.c. Only libopus is required.
+unless with_config('win32-binary-gem')
+  if have_library('opus', 'opus_encoder_create')
+    have_header('opus/opus.h') || have_header('opus.h')
+  end
 end
 
 RUBY_VERSION =~ /(\d+).(\d+)/
@@ -35,22 +35,42 @@
 #include <ruby.h>
 #include <ruby/thread.h>
 #include <ruby/encoding.h>
+#include <ruby/io.h>
 #include "rbflite.h"
 #include <flite/flite_version.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+#include <ruby/fiber/scheduler.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
 
 #ifndef MIN
-#define MIN(a, b) ((a) < (b)) ? (a) : (b)
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 #ifndef MAX
-#define MAX(a, b) ((a) > (b)) ? (a) : (b)
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
 #endif
 
-#ifdef WORDS_BIGENDIAN
-#define TO_LE4(num)  SWAPINT(num)
-#defien TO_LE2(num)  SWAPSHORT(num)
-#else
-#define TO_LE4(num)  (num)
-#define TO_LE2(num)  (num)
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 
 #ifdef HAVE_LAME_LAME_H
@@ -63,6 +83,15 @@
 #define HAVE_MP3LAME 1
 #endif
 
+#if defined(HAVE_OPUS_OPUS_H) || defined(HAVE_OPUS_H)
+#ifdef HAVE_OPUS_OPUS_H
+#include <opus/opus.h>
+#else
+#include <opus.h>
+#endif
+#define HAVE_OPUS 1
+#endif
+
 #ifdef HAVE_CST_AUDIO_STREAMING_INFO_UTT
 /* flite 2.0.0 */
 typedef struct cst_audio_streaming_info_struct *asc_last_arg_t;
@@ -73,12 +102,134 @@ typedef void *asc_last_arg_t;
 #define ASC_LAST_ARG_TO_USERDATA(last_arg) (last_arg)
 #endif
 
+/* native threads used to synthesize pieces of a text concurrently */
+#if defined(_WIN32)
+#define HAVE_NATIVE_THREAD 1
+typedef HANDLE native_thread_t;
+typedef LPTHREAD_START_ROUTINE native_thread_func_t;
+#define NATIVE_THREAD_FUNC(name, arg) static DWORD WINAPI name(LPVOID arg)
+#define NATIVE_THREAD_RETURN return 0
+
+static int native_thread_create(native_thread_t *th, native_thread_func_t func, void *arg)
+{
+    *th = CreateThread(NULL, 0, func, arg, 0, NULL);
+    return (*th != NULL) ? 0 : -1;
+}
+
+static void native_thread_join(native_thread_t th)
+{
+    WaitForSingleObject(th, INFINITE);
+    CloseHandle(th);
+}
+
+typedef CRITICAL_SECTION native_mutex_t;
+typedef CONDITION_VARIABLE native_cond_t;
+#define native_mutex_init(m) InitializeCriticalSection(m)
+#define native_mutex_destroy(m) DeleteCriticalSection(m)
+#define native_mutex_lock(m) EnterCriticalSection(m)
+#define native_mutex_unlock(m) LeaveCriticalSection(m)
+#define native_cond_init(c) InitializeConditionVariable(c)
+#define native_cond_destroy(c) ((void)(c))
+#define native_cond_wait(c, m) SleepConditionVariableCS((c), (m), INFINITE)
+#define native_cond_signal(c) WakeConditionVariable(c)
+#elif defined(HAVE_PTHREAD_H)
+#define HAVE_NATIVE_THREAD 1
+typedef pthread_t native_thread_t;
+typedef void *(*native_thread_func_t)(void *);
+#define NATIVE_THREAD_FUNC(name, arg) static void *name(void *arg)
+#define NATIVE_THREAD_RETURN return NULL
+
+static int native_thread_create(native_thread_t *th, native_thread_func_t func, void *arg)
+{
+    return (pthread_create(th, NULL, func, arg) == 0) ? 0 : -1;
+}
+
+static void native_thread_join(native_thread_t th)
+{
+    pthread_join(th, NULL);
+}
+
+typedef pthread_mutex_t native_mutex_t;
+typedef pthread_cond_t native_cond_t;
+#define native_mutex_init(m) pthread_mutex_init((m), NULL)
+#define native_mutex_destroy(m) pthread_mutex_destroy(m)
+#define native_mutex_lock(m) pthread_mutex_lock(m)
+#define native_mutex_unlock(m) pthread_mutex_unlock(m)
+#define native_cond_init(c) pthread_cond_init((c), NULL)
+#define native_cond_destroy(c) pthread_cond_destroy(c)
+#define native_cond_wait(c, m) pthread_cond_wait((c), (m))
+#define native_cond_signal(c) pthread_cond_signal(c)
+#endif
+
+#if defined(HAVE_NATIVE_THREAD) && defined(HAVE_MP3LAME) && defined(__ATOMIC_SEQ_CST)
+/* mp3 data can be encoded by another thread while the speech is synthesized. */
+#define HAVE_MP3_PIPELINE 1
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+#endif
+
+#if defined(HAVE_NATIVE_THREAD) && defined(HAVE_MP3LAME) && defined(HAVE_LAME_INIT_BITSTREAM)
+/* lame encoders are reused. The pool is accessed without the GVL. */
+#define HAVE_MP3_POOL 1
+#endif
+
+#if defined(HAVE_NATIVE_THREAD) && defined(HAVE_FEAT_LINK_INTO)
+/* Voice instances are needed to synthesize pieces concurrently. */
+#define HAVE_PARALLEL_SPEECH 1
+#endif
+
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H) && defined(HAVE_RB_FIBER_SCHEDULER_CURRENT)
+#define HAVE_FIBER_SCHEDULER 1
+#endif
+
+/*
+ * Static probes for bpftrace, perf and SystemTap, enabled by
+ * "extconf.rb --with-usdt". A disabled probe is a nop instruction.
+ * The provider name is ruby_flite.
+ *
+ *   queue_enter(voice), queue_acquire(voice), queue_release(voice)
+ *     around waiting for other calls on the voice
+ *   synth_start(vsd, text), synth_end(vsd, duration_usec)
+ *     around flite_text_to_speech()
+ *   chunk_start(vsd, num_samples), chunk_encoded(vsd, num_samples, total_bytes)
+ *     around resampling, encoding and writing a chunk of audio data
+ *   buffer_alloc(vsd, old_capa, new_capa)
+ *     when the buffer of audio data grows
+ *   result_start(vsd, bytes), result_end(vsd)
+ *     around shrinking the buffer to the result string
+ */
+#if defined(RBFLITE_USDT) && defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(ruby_flite, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(ruby_flite, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(ruby_flite, name, a, b, c)
+#else
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif
+
+/* Process-wide state is accessed by Ractors running in parallel. */
+#ifdef HAVE_NATIVE_THREAD
+#define SHARED_LOCK(m) native_mutex_lock(&(m))
+#define SHARED_UNLOCK(m) native_mutex_unlock(&(m))
+#else
+#define SHARED_LOCK(m) ((void)0)
+#define SHARED_UNLOCK(m) ((void)0)
+#endif
+
 enum rbfile_error {
     RBFLITE_ERROR_SUCCESS,
     RBFLITE_ERROR_OUT_OF_MEMORY,
     RBFLITE_ERROR_LAME_INIT_PARAMS,
     RBFLITE_ERROR_LAME_ENCODE_BUFFER,
     RBFLITE_ERROR_LAME_ENCODE_FLUSH,
+    RBFLITE_ERROR_WRITE,
+    RBFLITE_ERROR_OPUS,
+    RBFLITE_ERROR_OPUS_SAMPLE_RATE,
+    RBFLITE_ERROR_INTERRUPTED,
+    RBFLITE_ERROR_TIMEOUT,
+    RBFLITE_ERROR_MAX_BYTES,
 };
 
 void usenglish_init(cst_voice *v);
@@ -93,141 +244,683 @@ cst_lexicon *cmu_grapheme_lex_init(void);
 typedef struct thread_queue_entry {
     struct thread_queue_entry *next;
     VALUE thread;
+#ifdef HAVE_FIBER_SCHEDULER
+    VALUE scheduler; /* fiber scheduler of the waiting fiber. Qnil when the thread waits */
+    VALUE fiber;
+#endif
 } thread_queue_entry_t;
 
 typedef struct {
     thread_queue_entry_t *head;
     thread_queue_entry_t **tail;
+    long length; /* number of entries including head */
+    long max_waiters; /* -1 if unlimited */
+    double max_wait; /* seconds to wait before head. negative if unlimited */
 } thread_queue_t;
 
+/* an entry of the process-wide cache of voices */
+typedef struct voice_cache_entry {
+    struct voice_cache_entry *next;
+    char *key;
+    cst_voice *voice; /* read-only voice data shared by Flite::Voice objects */
+    int refcnt; /* number of Flite::Voice objects using this entry */
+    int evicted;
+} voice_cache_entry_t;
+
+/* statistics of a call. Times are in seconds. */
+typedef struct {
+    double queue_wait; /* time waiting for other calls on the voice */
+    double synthesis_time; /* wall-clock time of synthesis including encoding */
+    double cpu_time; /* CPU time of threads synthesizing audio data */
+    double encode_time; /* time in callbacks receiving audio data */
+    double duration; /* length of synthesized audio data */
+    size_t bytes; /* size of output audio data */
+} speech_stats_t;
+
 typedef struct {
     cst_voice *voice;
+    voice_cache_entry_t *cache_entry;
     thread_queue_t queue;
+    /* cumulative statistics protected by stats_mutex */
+    unsigned long num_calls;
+    unsigned long num_errors;
+    speech_stats_t stats;
 } rbflite_voice_t;
 
-#define MIN_BUFFER_LIST_SIZE (64 * 1024)
-typedef struct buffer_list {
-    struct buffer_list *next;
-    size_t size;
-    size_t used;
-    char buf[1];
-} buffer_list_t;
+#define MIN_SPEECH_DATA_SIZE (64 * 1024)
+#define MIN_SPEECH_CHUNK_SIZE (4 * 1024)
+
+#define WAV_HEADER_SIZE 44 /* size of the WAVE header of PCM data */
+#define WAV_HEADER_EXT_SIZE 58 /* size with the 18-byte fmt chunk and the fact chunk */
+
+/* WAVE header in little endian. Formats other than PCM need the fact chunk. */
+typedef struct {
+    unsigned char bytes[WAV_HEADER_EXT_SIZE];
+    int size; /* WAV_HEADER_SIZE or WAV_HEADER_EXT_SIZE */
+    int block_align;
+    int data_size;
+} wav_header_t;
 
+/* polyphase sample rate converter placed before the encoder */
 typedef struct {
+    cst_audio_stream_callback asc; /* callback receiving resampled audio data */
+    int out_rate;
+    int in_rate; /* sample rate of the current input. 0 before the first chunk */
+    int passthrough; /* nonzero when the input isn't resampled */
+    int up; /* out_rate / gcd(in_rate, out_rate) */
+    int down; /* in_rate / gcd(in_rate, out_rate) */
+    int num_phases;
+    int half; /* number of filter taps on each side of the center */
+    int num_taps; /* number of filter taps per phase, a multiple of 4 */
+    int coefs_capa;
+    float *coefs; /* num_phases * num_taps coefficients */
+    float *hist; /* input samples not consumed yet */
+    size_t hist_len;
+    size_t hist_capa;
+    size_t pos; /* index in hist of the input sample just before the next output */
+    int frac; /* fractional part of the position in units of 1/up */
+    cst_wave wave; /* resampled audio data */
+    size_t wave_capa;
+    int out_len; /* number of samples written to wave */
+    int out_sent; /* number of samples passed to asc */
+} resampler_t;
+
+typedef struct voice_speech_data {
     cst_voice *voice;
     const char *text;
     const char *outtype;
     void *encoder;
-    buffer_list_t *buffer_list;
-    buffer_list_t *buffer_list_last;
+    /* Audio data are written to the string directly without the GVL.
+     * It is referred only by the machine stack while it is written. */
+    VALUE speech_data;
+    char *ptr; /* RSTRING_PTR(speech_data) */
+    size_t capa; /* capacity of speech_data */
+    size_t used; /* length of data written to speech_data */
+    size_t new_capa; /* argument of speech_data_expand */
+    VALUE speech_data_list; /* array to keep speech_data of to_speech_batch */
+    long num_speech_data; /* number of speech_data allocated */
+    int yield_chunks; /* nonzero when a block is passed to to_speech */
     enum rbfile_error error;
+    int errnum; /* errno, an opus error code or a sample rate, depending on error */
+    cst_audio_stream_callback asc; /* encoder callback wrapped by yield_encoder_cb */
+    int state; /* nonzero when an exception is raised with the GVL in callbacks */
+    int fd; /* file descriptor used by to_speech_io. -1 otherwise. */
+    size_t written; /* bytes written to fd */
+    off_t wav_header_offset; /* position of the WAVE header in fd. -1 if fd isn't seekable. */
+    wav_header_t wav_header;
+    resampler_t *resampler; /* NULL when the sample rate isn't converted */
+    cst_audio_stream_callback stream_asc; /* callback called by stream_guard_cb */
+    volatile int interrupted; /* set by voice_speech_ubf. cleared when interrupts are checked */
+    volatile int stopped; /* nonzero when synthesis must stop because an exception is pending */
+    struct voice_speech_data *owner; /* vsd passed to voice_speech_ubf. itself except in to_speech_multi */
+    void (*volatile unblock)(void *); /* called by voice_speech_ubf to wake up a waiting native thread */
+    void *unblock_arg;
+    double deadline; /* monotonic time when synthesis times out. 0 if no timeout */
+    size_t max_bytes; /* maximum size of audio data. 0 if no limit */
+    size_t num_bytes; /* size of audio data added so far */
+    VALUE chunk_queue; /* queue passing chunks from a worker thread to the fiber. Qnil if not used */
+    speech_stats_t stats;
 } voice_speech_data_t;
 
+typedef struct {
+    voice_speech_data_t vsd;
+    const char **texts;
+    long num_texts;
+    long done; /* number of converted texts */
+    long *indexes; /* index of audio data of each text in vsd.speech_data_list. -1 if no data */
+    size_t *sizes; /* size of audio data of each text */
+    int yield_each; /* nonzero when a block is passed to to_speech_batch */
+} voice_speech_batch_t;
+
+#ifdef HAVE_PARALLEL_SPEECH
+#define MIN_SPEECH_PIECE_LEN 200 /* minimum length of text synthesized by a thread */
+#define SPEECH_PIECE_CHUNK_SIZE 4096 /* number of samples passed to the encoder at once */
+
+/* a piece of text synthesized by a native thread */
+typedef struct {
+    voice_speech_data_t *vsd; /* changed only when in_caller is nonzero */
+    cst_voice *voice;
+    char *text;
+    short *samples; /* synthesized audio data */
+    size_t num_samples;
+    size_t capa;
+    int sample_rate;
+    int num_channels;
+    int error; /* nonzero when memory allocation failed */
+    int started; /* nonzero when a native thread is created for this piece */
+    int in_caller; /* nonzero when this piece is synthesized by the calling thread */
+    volatile int finished; /* set when a native thread finishes synthesis */
+    native_thread_t thread;
+    double duration; /* returned by flite_text_to_speech() */
+    double cpu_time; /* CPU time of the thread */
+} speech_piece_t;
+
+typedef struct {
+    voice_speech_data_t *vsd;
+    const cst_voice *voice; /* voice data shared by voice instances of pieces */
+    const long *offsets; /* start positions of pieces in vsd.text and its length */
+    int num_pieces;
+} voice_speech_parallel_t;
+#endif
+
 typedef struct {
     cst_audio_stream_callback asc;
     void *(*encoder_init)(VALUE opts);
     void (*encoder_fini)(void *encoder);
 } audio_stream_encoder_t;
 
+/* an output format of to_speech_multi */
+typedef struct {
+    voice_speech_data_t vsd;
+    audio_stream_encoder_t *encoder;
+    VALUE opts;
+#ifdef HAVE_CST_AUDIO_STREAMING_INFO_UTT
+    cst_audio_streaming_info asi; /* passed to the encoder with userdata replaced by &vsd */
+#endif
+} speech_target_t;
+
+typedef struct {
+    voice_speech_data_t vsd; /* This must be the first member. */
+    speech_target_t *targets;
+    long num_targets;
+    long num_initialized; /* number of targets whose encoders are initialized */
+} voice_speech_multi_t;
+
 static VALUE rb_mFlite;
 static VALUE rb_eFliteError;
 static VALUE rb_eFliteRuntimeError;
+static VALUE rb_eFliteBusyError;
+static VALUE rb_eFliteTimeoutError;
+static VALUE rb_eFliteOutputLimitError;
 static VALUE rb_cVoice;
+#ifdef HAVE_FIBER_SCHEDULER
+static VALUE rb_cSizedQueue;
+#endif
+static VALUE sym_flac;
+static VALUE sym_ulaw;
+static VALUE sym_alaw;
 static VALUE sym_mp3;
+static VALUE sym_opus;
 static VALUE sym_raw;
 static VALUE sym_wav;
 static struct timeval sleep_time_after_speaking;
+#ifdef HAVE_NATIVE_THREAD
+static native_mutex_t settings_mutex; /* protects sleep_time_after_speaking */
+static native_mutex_t voice_cache_mutex; /* protects voice_cache and refcnt of its entries */
+static native_mutex_t stats_mutex; /* protects statistics in rbflite_voice_t */
+#endif
+static voice_cache_entry_t *voice_cache;
 
-static buffer_list_t *buffer_list_alloc(size_t size);
+static VALUE speech_data_finish(voice_speech_data_t *vsd);
 static void check_error(voice_speech_data_t *vsd);
+static double monotonic_time(void);
 
-static void lock_thread(thread_queue_t *queue, thread_queue_entry_t *entry)
+static void wakeup_thread(thread_queue_entry_t *entry)
 {
-    /* enqueue the current thread to voice->queue. */
-    entry->next = NULL;
-    *queue->tail = entry;
-    queue->tail = &entry->next;
-    if (queue->head != entry) {
-        /* stop the current thread if other threads run. */
-        entry->thread = rb_thread_current();
-        rb_thread_stop();
+#ifdef HAVE_FIBER_SCHEDULER
+    if (!NIL_P(entry->scheduler)) {
+        rb_fiber_scheduler_unblock(entry->scheduler, entry->fiber, entry->fiber);
+        return;
     }
+#endif
+    rb_thread_wakeup_alive(entry->thread);
 }
 
 static void unlock_thread(thread_queue_t *queue)
 {
     /* dequeue the current thread from voice->queue. */
     queue->head = queue->head->next;
+    queue->length--;
     if (queue->head == NULL) {
         queue->tail = &queue->head;
     } else {
         /* resume the top of blocked threads. */
-        rb_thread_wakeup_alive(queue->head->thread);
+        wakeup_thread(queue->head);
     }
 }
 
-static int add_data(voice_speech_data_t *vsd, const void *data, size_t size)
+/* removes an entry which isn't the head. */
+static void thread_queue_remove(thread_queue_t *queue, thread_queue_entry_t *entry)
 {
-    buffer_list_t *list;
-    size_t rest;
+    thread_queue_entry_t **ptr = &queue->head;
 
-    if (vsd->buffer_list == NULL) {
-        list = buffer_list_alloc(size);
-        if (list == NULL) {
-            vsd->error = RBFLITE_ERROR_OUT_OF_MEMORY;
+    while (*ptr != entry) {
+        ptr = &(*ptr)->next;
+    }
+    *ptr = entry->next;
+    if (queue->tail == &entry->next) {
+        queue->tail = ptr;
+    }
+    queue->length--;
+}
+
+typedef struct {
+    thread_queue_t *queue;
+    thread_queue_entry_t *entry;
+} lock_thread_arg_t;
+
+/* returns Qtrue when queue->max_wait elapses. */
+static VALUE lock_thread_wait(VALUE arg)
+{
+    lock_thread_arg_t *lta = (lock_thread_arg_t *)arg;
+    double deadline = (lta->queue->max_wait >= 0) ? monotonic_time() + lta->queue->max_wait : 0;
+
+    while (lta->queue->head != lta->entry) {
+        double rest = 0;
+
+        if (deadline != 0) {
+            rest = deadline - monotonic_time();
+            if (rest <= 0) {
+                return Qtrue;
+            }
+        }
+#ifdef HAVE_FIBER_SCHEDULER
+        if (!NIL_P(lta->entry->scheduler)) {
+            /* other fibers run while this fiber waits. */
+            rb_fiber_scheduler_block(lta->entry->scheduler, lta->entry->fiber,
+                                     (deadline != 0) ? DBL2NUM(rest) : Qnil);
+            continue;
+        }
+#endif
+        if (deadline != 0) {
+            struct timeval tv;
+
+            tv.tv_sec = (time_t)rest;
+            tv.tv_usec = (long)((rest - tv.tv_sec) * 1e6);
+            /* unlock_thread() wakes this thread before the time elapses. */
+            rb_thread_wait_for(tv);
+        } else {
+            rb_thread_stop();
+        }
+    }
+    return Qfalse;
+}
+
+/*
+ * Raises Flite::BusyError when the number of waiting calls would
+ * exceed queue->max_waiters or the wait exceeds queue->max_wait.
+ */
+static void lock_thread(thread_queue_t *queue, thread_queue_entry_t *entry)
+{
+    if (queue->head != NULL && queue->max_waiters >= 0 && queue->length - 1 >= queue->max_waiters) {
+        rb_raise(rb_eFliteBusyError, "voice is busy (%ld calls waiting)", queue->length - 1);
+    }
+    /* enqueue the current thread to voice->queue. */
+    entry->next = NULL;
+    entry->thread = rb_thread_current();
+#ifdef HAVE_FIBER_SCHEDULER
+    entry->scheduler = rb_fiber_scheduler_current();
+    entry->fiber = NIL_P(entry->scheduler) ? Qnil : rb_fiber_current();
+#endif
+    *queue->tail = entry;
+    queue->tail = &entry->next;
+    queue->length++;
+    if (queue->head != entry) {
+        /* stop the current thread if other threads run. */
+        lock_thread_arg_t lta;
+        int state = 0;
+        VALUE timed_out;
+
+        lta.queue = queue;
+        lta.entry = entry;
+        timed_out = rb_protect(lock_thread_wait, (VALUE)&lta, &state);
+        if (state != 0) {
+            /* remove the entry when an exception is raised while waiting. */
+            if (queue->head == entry) {
+                unlock_thread(queue);
+            } else {
+                thread_queue_remove(queue, entry);
+            }
+            rb_jump_tag(state);
+        }
+        if (timed_out == Qtrue) {
+            thread_queue_remove(queue, entry);
+            rb_raise(rb_eFliteBusyError, "voice is busy (waited %g seconds)", queue->max_wait);
+        }
+    }
+}
+
+static void voice_speech_data_init(voice_speech_data_t *vsd, cst_voice *voice, const char *text, const char *outtype)
+{
+    vsd->voice = voice;
+    vsd->text = text;
+    vsd->outtype = outtype;
+    vsd->encoder = NULL;
+    vsd->speech_data = Qnil;
+    vsd->ptr = NULL;
+    vsd->capa = 0;
+    vsd->used = 0;
+    vsd->new_capa = 0;
+    vsd->speech_data_list = Qnil;
+    vsd->num_speech_data = 0;
+    vsd->yield_chunks = 0;
+    vsd->error = RBFLITE_ERROR_SUCCESS;
+    vsd->errnum = 0;
+    vsd->asc = NULL;
+    vsd->state = 0;
+    vsd->fd = -1;
+    vsd->written = 0;
+    vsd->wav_header_offset = -1;
+    vsd->resampler = NULL;
+    vsd->stream_asc = NULL;
+    vsd->interrupted = 0;
+    vsd->stopped = 0;
+    vsd->owner = vsd;
+    vsd->unblock = NULL;
+    vsd->unblock_arg = NULL;
+    vsd->deadline = 0;
+    vsd->max_bytes = 0;
+    vsd->num_bytes = 0;
+    memset(&vsd->stats, 0, sizeof(vsd->stats));
+    vsd->chunk_queue = Qnil;
+}
+
+static double monotonic_time(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#elif defined(_WIN32)
+    return GetTickCount64() * 1e-3;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+/* returns CPU time of the current thread or 0 when it isn't available. */
+static double thread_cpu_time(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#elif defined(_WIN32)
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+
+    if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+        return 0;
+    }
+    /* in units of 100 nanoseconds */
+    return ((((ULONGLONG)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime)
+            + (((ULONGLONG)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime)) * 1e-7;
+#else
+    return 0;
+#endif
+}
+
+/* sets :timeout and :max_bytes in opts to vsd. */
+static void speech_limits_init(voice_speech_data_t *vsd, VALUE opts)
+{
+    VALUE v;
+
+    if (!RB_TYPE_P(opts, T_HASH)) {
+        return;
+    }
+    v = rb_hash_aref(opts, ID2SYM(rb_intern("timeout")));
+    if (!NIL_P(v)) {
+        double timeout = NUM2DBL(v);
+
+        if (!(timeout > 0)) {
+            rb_raise(rb_eArgError, "timeout must be positive");
+        }
+        vsd->deadline = monotonic_time() + timeout;
+    }
+    v = rb_hash_aref(opts, ID2SYM(rb_intern("max_bytes")));
+    if (!NIL_P(v)) {
+        vsd->max_bytes = NUM2SIZET(v);
+        if (vsd->max_bytes == 0) {
+            rb_raise(rb_eArgError, "max_bytes must be positive");
+        }
+    }
+}
+
+/* returns nonzero when synthesis must be stopped. This doesn't change vsd. */
+static int speech_interrupted(const voice_speech_data_t *vsd)
+{
+    return vsd->stopped || (vsd->deadline != 0 && monotonic_time() >= vsd->deadline);
+}
+
+static VALUE
+speech_check_ints_body(VALUE arg)
+{
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+/*
+ * runs pending interrupts with the GVL. Signal handlers and
+ * Thread#wakeup don't stop synthesis. When an exception is
+ * raised, it is kept in vsd->state and synthesis is stopped.
+ */
+static void *
+speech_check_ints(void *data)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)data;
+    int state = 0;
+
+    rb_protect(speech_check_ints_body, Qnil, &state);
+    if (state != 0) {
+        vsd->state = state;
+        vsd->stopped = 1;
+    }
+    return NULL;
+}
+
+/*
+ * sets an error and returns -1 when synthesis must be stopped.
+ * This must be called by a ruby thread without the GVL.
+ */
+static int check_interrupt(voice_speech_data_t *vsd)
+{
+    if (vsd->interrupted && !vsd->stopped) {
+        vsd->interrupted = 0;
+        rb_thread_call_with_gvl(speech_check_ints, vsd);
+    }
+    if (!speech_interrupted(vsd)) {
+        return 0;
+    }
+    if (vsd->error == RBFLITE_ERROR_SUCCESS) {
+        vsd->error = vsd->stopped ? RBFLITE_ERROR_INTERRUPTED : RBFLITE_ERROR_TIMEOUT;
+    }
+    return -1;
+}
+
+/* unblocking function which makes audio stream callbacks stop synthesis. */
+static void voice_speech_ubf(void *data)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)data;
+    void (*unblock)(void *) = vsd->unblock;
+
+    vsd->interrupted = 1;
+    if (unblock != NULL) {
+        unblock(vsd->unblock_arg);
+    }
+}
+
+/*
+ * writes data to fd without the GVL. While fd isn't writable, stop(arg)
+ * is called periodically and this returns -1 when it returns nonzero.
+ * On write errors, this returns -1 and sets *errnum. The number of
+ * written bytes is added to *written.
+ */
+static int write_fd(int fd, const void *data, size_t size, size_t *written, int *errnum, int (*stop)(void *), void *arg)
+{
+    while (size > 0) {
+        ssize_t rv = write(fd, data, size);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+#ifdef HAVE_POLL_H
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* The fd is in nonblocking mode. Wait until it is writable. */
+                struct pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                /* wake up periodically to check interruption and timeout. */
+                if (poll(&pfd, 1, 100) >= 0 || errno == EINTR) {
+                    if (stop(arg)) {
+                        return -1;
+                    }
+                    continue;
+                }
+            }
+#endif
+            *errnum = errno;
             return -1;
         }
-        vsd->buffer_list = vsd->buffer_list_last = list;
+        data = (const char*)data + rv;
+        size -= rv;
+        *written += rv;
+    }
+    return 0;
+}
+
+static int write_data_stop(void *arg)
+{
+    return check_interrupt((voice_speech_data_t *)arg) != 0;
+}
+
+/* write data to vsd->fd without the GVL. This must be called by a ruby thread. */
+static int write_data(voice_speech_data_t *vsd, const void *data, size_t size)
+{
+    int errnum = 0;
+
+    if (write_fd(vsd->fd, data, size, &vsd->written, &errnum, write_data_stop, vsd) != 0) {
+        if (errnum != 0) {
+            vsd->error = RBFLITE_ERROR_WRITE;
+            vsd->errnum = errnum;
+        }
+        return -1;
     }
-    list = vsd->buffer_list_last;
-    rest = list->size - list->used;
-    if (size <= rest) {
-        memcpy(list->buf + list->used, data, size);
-        list->used += size;
+    return 0;
+}
+
+static VALUE speech_data_expand_body(VALUE arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)arg;
+
+    if (NIL_P(vsd->speech_data)) {
+        vsd->speech_data = rb_str_buf_new(vsd->new_capa);
+        if (!NIL_P(vsd->speech_data_list)) {
+            rb_ary_push(vsd->speech_data_list, vsd->speech_data);
+        }
+        vsd->num_speech_data++;
     } else {
-        memcpy(list->buf + list->used, data, rest);
-        list->used += rest;
-        data = (const char*)data + rest;
-        size -= rest;
-        list = buffer_list_alloc(size);
-        if (list == NULL) {
-            vsd->error = RBFLITE_ERROR_OUT_OF_MEMORY;
+        rb_str_set_len(vsd->speech_data, vsd->used);
+        rb_str_modify_expand(vsd->speech_data, vsd->new_capa - vsd->used);
+    }
+    vsd->ptr = RSTRING_PTR(vsd->speech_data);
+    vsd->capa = rb_str_capacity(vsd->speech_data);
+    return Qnil;
+}
+
+static void *speech_data_expand(void *data)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)data;
+
+    rb_protect(speech_data_expand_body, (VALUE)vsd, &vsd->state);
+    return NULL;
+}
+
+/* expand the capacity of vsd->speech_data to capa bytes with the GVL. */
+static int expand_data(voice_speech_data_t *vsd, size_t capa)
+{
+    PROBE3(buffer_alloc, vsd, vsd->capa, capa);
+    vsd->new_capa = capa;
+    rb_thread_call_with_gvl(speech_data_expand, vsd);
+    if (vsd->state != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Reserves space for size bytes when the size of audio data is
+ * known before it is written. This does nothing when audio data
+ * are passed to a block or written to a file descriptor.
+ */
+static int reserve_data(voice_speech_data_t *vsd, size_t size)
+{
+    if (vsd->fd != -1 || vsd->yield_chunks) {
+        return 0;
+    }
+    if (vsd->max_bytes != 0 && size > vsd->max_bytes - vsd->num_bytes) {
+        /* add_data fails when the limit is reached. */
+        size = vsd->max_bytes - vsd->num_bytes;
+    }
+    if (vsd->used + size > vsd->capa) {
+        return expand_data(vsd, vsd->used + size);
+    }
+    return 0;
+}
+
+static int add_data(voice_speech_data_t *vsd, const void *data, size_t size)
+{
+    if (vsd->max_bytes != 0 && size > vsd->max_bytes - vsd->num_bytes) {
+        vsd->error = RBFLITE_ERROR_MAX_BYTES;
+        return -1;
+    }
+    vsd->num_bytes += size;
+    if (vsd->fd != -1) {
+        return write_data(vsd, data, size);
+    }
+
+    if (vsd->used + size > vsd->capa) {
+        /* grow geometrically */
+        size_t min_size = vsd->yield_chunks ? MIN_SPEECH_CHUNK_SIZE : MIN_SPEECH_DATA_SIZE;
+        size_t capa = MAX(vsd->capa * 2, min_size);
+        if (expand_data(vsd, MAX(capa, vsd->used + size)) != 0) {
             return -1;
         }
-        memcpy(list->buf, data, size);
-        list->used = size;
-        vsd->buffer_list_last->next = list;
-        vsd->buffer_list_last = list;
     }
+    memcpy(vsd->ptr + vsd->used, data, size);
+    vsd->used += size;
     return 0;
 }
 
-static buffer_list_t *buffer_list_alloc(size_t size)
+/* returns vsd->speech_data as a string and detaches it from vsd. */
+static VALUE speech_data_finish(voice_speech_data_t *vsd)
 {
-    size_t alloc_size = MAX(size + offsetof(buffer_list_t, buf), MIN_BUFFER_LIST_SIZE);
-    buffer_list_t *list = xmalloc(alloc_size);
+    VALUE str = vsd->speech_data;
 
-    if (list == NULL) {
-        return NULL;
+    if (NIL_P(str)) {
+        return rb_str_new(NULL, 0);
     }
-    list->next = NULL;
-    list->size = alloc_size - offsetof(buffer_list_t, buf);
-    list->used = 0;
-    return list;
+    PROBE2(result_start, vsd, vsd->used);
+    rb_str_set_len(str, vsd->used);
+    /* release unused space */
+    rb_str_resize(str, vsd->used);
+    PROBE1(result_end, vsd);
+    vsd->speech_data = Qnil;
+    vsd->ptr = NULL;
+    vsd->capa = 0;
+    vsd->used = 0;
+    return str;
 }
 
 static void check_error(voice_speech_data_t *vsd)
 {
-    buffer_list_t *list, *list_next;
-
+    if (vsd->state != 0) {
+        /* an exception was raised with the GVL in an audio stream callback. */
+        rb_jump_tag(vsd->state);
+    }
     if (vsd->error == RBFLITE_ERROR_SUCCESS) {
         return;
     }
-    for (list = vsd->buffer_list; list != NULL; list = list_next) {
-        list_next = list->next;
-        xfree(list);
+    if (!NIL_P(vsd->speech_data)) {
+        /* free the buffer before raising an exception. */
+        rb_str_resize(vsd->speech_data, 0);
+        vsd->speech_data = Qnil;
     }
-    vsd->buffer_list = NULL;
     switch (vsd->error) {
     case RBFLITE_ERROR_OUT_OF_MEMORY:
         rb_raise(rb_eNoMemError, "out of memory while writing speech data");
@@ -237,6 +930,22 @@ static void check_error(voice_speech_data_t *vsd)
         rb_raise(rb_eFliteRuntimeError, "lame_encode_buffer() error");
     case RBFLITE_ERROR_LAME_ENCODE_FLUSH:
         rb_raise(rb_eFliteRuntimeError, "lame_encode_flush() error");
+    case RBFLITE_ERROR_WRITE:
+        rb_syserr_fail(vsd->errnum, "write");
+#ifdef HAVE_OPUS
+    case RBFLITE_ERROR_OPUS:
+        rb_raise(rb_eFliteRuntimeError, "opus error: %s", opus_strerror(vsd->errnum));
+    case RBFLITE_ERROR_OPUS_SAMPLE_RATE:
+        rb_raise(rb_eFliteRuntimeError, "opus doesn't support sample rate %d", vsd->errnum);
+#endif
+    case RBFLITE_ERROR_INTERRUPTED:
+        /* The exception is usually raised by rb_jump_tag(vsd->state) above. */
+        rb_thread_check_ints();
+        rb_raise(rb_eFliteRuntimeError, "speech synthesis was interrupted");
+    case RBFLITE_ERROR_TIMEOUT:
+        rb_raise(rb_eFliteTimeoutError, "speech synthesis timed out");
+    case RBFLITE_ERROR_MAX_BYTES:
+        rb_raise(rb_eFliteOutputLimitError, "audio data exceeded %"PRIsVALUE" bytes", SIZET2NUM(vsd->max_bytes));
     default:
         rb_raise(rb_eFliteRuntimeError, "Unkown error %d", vsd->error);
     }
@@ -269,10 +978,13 @@ flite_s_list_builtin_voices(VALUE klass)
  *
  *  @example
  *    # Compiled with mp3 support
- *    Flite.supported_audio_types # => [:wav, :raw, :mp3]
+ *    Flite.supported_audio_types # => [:wav, :raw, :flac, :ulaw, :alaw, :mp3]
  *
  *    # Compiled without mp3 support
- *    Flite.supported_audio_types # => [:wav, :raw]
+ *    Flite.supported_audio_types # => [:wav, :raw, :flac, :ulaw, :alaw]
+ *
+ *    # Compiled with mp3 and opus support
+ *    Flite.supported_audio_types # => [:wav, :raw, :flac, :ulaw, :alaw, :mp3, :opus]
  *
  *  @return [Array]
  */
@@ -283,8 +995,14 @@ flite_s_supported_audio_types(VALUE klass)
 
     rb_ary_push(ary, sym_wav);
     rb_ary_push(ary, sym_raw);
+    rb_ary_push(ary, sym_flac);
+    rb_ary_push(ary, sym_ulaw);
+    rb_ary_push(ary, sym_alaw);
 #ifdef HAVE_MP3LAME
     rb_ary_push(ary, sym_mp3);
+#endif
+#ifdef HAVE_OPUS
+    rb_ary_push(ary, sym_opus);
 #endif
     return ary;
 }
@@ -307,26 +1025,279 @@ flite_s_supported_audio_types(VALUE klass)
 static VALUE
 flite_s_set_sleep_time_after_speaking(VALUE klass, VALUE val)
 {
-    sleep_time_after_speaking = rb_time_interval(val);
+    struct timeval tv = rb_time_interval(val);
+
+    SHARED_LOCK(settings_mutex);
+    sleep_time_after_speaking = tv;
+    SHARED_UNLOCK(settings_mutex);
     return val;
 }
 
-static void
-rbfile_voice_free(rbflite_voice_t *voice)
+#ifdef HAVE_FEAT_LINK_INTO
+static voice_cache_entry_t *
+voice_cache_lookup(const char *key)
 {
-    if (voice->voice) {
-        delete_voice(voice->voice);
-        voice->voice = NULL;
+    voice_cache_entry_t *entry;
+
+    for (entry = voice_cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            return entry;
+        }
     }
+    return NULL;
 }
 
+/* This is called with voice_cache_mutex locked. It returns NULL when memory allocation fails. */
+static voice_cache_entry_t *
+voice_cache_add(const char *key, cst_voice *voice)
+{
+    voice_cache_entry_t *entry = malloc(sizeof(voice_cache_entry_t));
+
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->key = strdup(key);
+    if (entry->key == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->voice = voice;
+    entry->refcnt = 0;
+    entry->evicted = 0;
+    entry->next = voice_cache;
+    voice_cache = entry;
+    return entry;
+}
+
+/*
+ * Returns the cache entry of <code>key</code> and increments its
+ * reference count. When it isn't cached, <code>voice</code> is added
+ * unless it is NULL. The caller must delete <code>voice</code> when
+ * the returned entry doesn't use it.
+ */
+static voice_cache_entry_t *
+voice_cache_acquire(const char *key, cst_voice *voice)
+{
+    voice_cache_entry_t *entry;
+
+    SHARED_LOCK(voice_cache_mutex);
+    entry = voice_cache_lookup(key);
+    if (entry == NULL && voice != NULL) {
+        entry = voice_cache_add(key, voice);
+    }
+    if (entry != NULL) {
+        entry->refcnt++;
+    }
+    SHARED_UNLOCK(voice_cache_mutex);
+    return entry;
+}
+
+/*
+ * Creates a voice sharing the read-only data of <code>voice</code>.
+ * Its own features such as "streaming_info" are set to the new
+ * voice and others are looked up in linked features.
+ */
+static cst_voice *
+voice_instance_new(const cst_voice *voice)
+{
+    cst_voice *inst = new_voice();
+
+    inst->name = voice->name;
+    inst->utt_init = voice->utt_init;
+    feat_link_into(voice->features, inst->features);
+    feat_link_into(voice->ffunctions, inst->ffunctions);
+    return inst;
+}
+
+/* uses an entry returned by voice_cache_acquire(). */
+static void
+rbflite_voice_use_cache_entry(rbflite_voice_t *voice, voice_cache_entry_t *entry)
+{
+    voice->voice = voice_instance_new(entry->voice);
+    voice->cache_entry = entry;
+}
+#endif
+
+static void
+voice_cache_entry_release(voice_cache_entry_t *entry)
+{
+    int unused;
+
+    SHARED_LOCK(voice_cache_mutex);
+    unused = (--entry->refcnt == 0 && entry->evicted);
+    SHARED_UNLOCK(voice_cache_mutex);
+    if (unused) {
+        delete_voice(entry->voice);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+/*
+ *  Returns names of voices in the voice cache.
+ *
+ *  Voices created by {Flite::Voice#initialize} are cached and
+ *  their read-only data such as unit databases, lexicons and
+ *  CART trees are shared by voices created with the same name later.
+ *
+ *  @example
+ *    Flite::Voice.new('slt')
+ *    Flite::Voice.new('/path/to/cmu_us_aup.flitevox')
+ *    Flite.cached_voices # => ['/path/to/cmu_us_aup.flitevox', 'slt']
+ *
+ *  @return [Array]
+ */
+static VALUE
+flite_s_cached_voices(VALUE klass)
+{
+    VALUE ary = rb_ary_new();
+    VALUE buf = Qnil;
+    long size = 0;
+    long len;
+    const char *ptr;
+
+    /* Keys are copied to buf with voice_cache_mutex locked and Ruby
+     * objects are created after it is unlocked because GC may release
+     * cache entries. */
+    for (;;) {
+        voice_cache_entry_t *entry;
+
+        SHARED_LOCK(voice_cache_mutex);
+        len = 0;
+        for (entry = voice_cache; entry != NULL; entry = entry->next) {
+            len += strlen(entry->key) + 1;
+        }
+        if (len <= size) {
+            char *dest = (len > 0) ? RSTRING_PTR(buf) : NULL;
+
+            for (entry = voice_cache; entry != NULL; entry = entry->next) {
+                size_t keylen = strlen(entry->key) + 1;
+
+                memcpy(dest, entry->key, keylen);
+                dest += keylen;
+            }
+        }
+        SHARED_UNLOCK(voice_cache_mutex);
+        if (len <= size) {
+            break;
+        }
+        size = len;
+        buf = rb_str_new(NULL, size);
+    }
+    for (ptr = (len > 0) ? RSTRING_PTR(buf) : NULL; len > 0; ) {
+        long keylen = strlen(ptr);
+
+        rb_ary_push(ary, rb_str_new(ptr, keylen));
+        ptr += keylen + 1;
+        len -= keylen + 1;
+    }
+    RB_GC_GUARD(buf);
+    return ary;
+}
+
+/*
+ * @overload evict_cached_voice(name)
+ *
+ *  Removes the voice specified by <code>name</code> from the voice cache.
+ *  Its memory is freed when all voices using it are garbage collected.
+ *  A new voice created with the name loads the voice again.
+ *
+ *  @param [String] name
+ *  @return [Boolean] true if the voice was in the cache
+ */
+static VALUE
+flite_s_evict_cached_voice(VALUE klass, VALUE name)
+{
+    voice_cache_entry_t **prev = &voice_cache;
+    voice_cache_entry_t *entry;
+    const char *key = StringValueCStr(name);
+
+    SHARED_LOCK(voice_cache_mutex);
+    for (entry = voice_cache; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            *prev = entry->next;
+            entry->evicted = 1;
+            entry->refcnt++;
+            break;
+        }
+        prev = &entry->next;
+    }
+    SHARED_UNLOCK(voice_cache_mutex);
+    RB_GC_GUARD(name);
+    if (entry == NULL) {
+        return Qfalse;
+    }
+    voice_cache_entry_release(entry);
+    return Qtrue;
+}
+
+/*
+ *  Removes all voices from the voice cache.
+ *
+ *  @see Flite.evict_cached_voice
+ */
+static VALUE
+flite_s_clear_voice_cache(VALUE klass)
+{
+    voice_cache_entry_t *head;
+    voice_cache_entry_t *entry;
+
+    SHARED_LOCK(voice_cache_mutex);
+    head = voice_cache;
+    voice_cache = NULL;
+    for (entry = head; entry != NULL; entry = entry->next) {
+        entry->evicted = 1;
+        entry->refcnt++;
+    }
+    SHARED_UNLOCK(voice_cache_mutex);
+    /* Entries aren't reachable from voice_cache now. */
+    entry = head;
+    while (entry != NULL) {
+        voice_cache_entry_t *next = entry->next;
+        voice_cache_entry_release(entry);
+        entry = next;
+    }
+    return Qnil;
+}
+
+static void
+rbfile_voice_free(rbflite_voice_t *voice)
+{
+    if (voice->voice) {
+        delete_voice(voice->voice);
+        voice->voice = NULL;
+    }
+    if (voice->cache_entry) {
+        voice_cache_entry_release(voice->cache_entry);
+        voice->cache_entry = NULL;
+    }
+    xfree(voice);
+}
+
+#if defined(HAVE_FEAT_LINK_INTO) && defined(RUBY_TYPED_FROZEN_SHAREABLE)
+/* A frozen voice is shareable because each call uses its own voice instance. */
+#define VOICE_DATA_TYPE_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE)
+#elif defined(RUBY_TYPED_FREE_IMMEDIATELY)
+#define VOICE_DATA_TYPE_FLAGS RUBY_TYPED_FREE_IMMEDIATELY
+#endif
+
+static const rb_data_type_t voice_data_type = {
+    "Flite::Voice",
+    {NULL, (void (*)(void *))rbfile_voice_free, NULL,},
+#ifdef VOICE_DATA_TYPE_FLAGS
+    NULL, NULL, VOICE_DATA_TYPE_FLAGS
+#endif
+};
+
 static VALUE
 rbflite_voice_s_allocate(VALUE klass)
 {
     rbflite_voice_t *voice;
-    VALUE obj = Data_Make_Struct(klass, rbflite_voice_t, NULL, rbfile_voice_free, voice);
+    VALUE obj = TypedData_Make_Struct(klass, rbflite_voice_t, &voice_data_type, voice);
 
     voice->queue.tail = &voice->queue.head;
+    voice->queue.max_waiters = -1;
+    voice->queue.max_wait = -1;
     return obj;
 }
 
@@ -339,7 +1310,126 @@ rbflite_voice_load(void *data)
 #endif
 
 /*
- * @overload initialize(name = nil)
+ * @overload max_waiters=(num)
+ *
+ *  Sets the maximum number of calls waiting for the voice used by
+ *  another call. When a call would exceed it, {Flite::BusyError} is
+ *  raised immediately. 0 raises it whenever the voice is busy.
+ *  nil, the default, means no limit.
+ *
+ *  Calls on a frozen voice don't wait. See {#initialize}.
+ *
+ *  @param [Integer, nil] num
+ */
+static VALUE
+rbflite_voice_set_max_waiters(VALUE self, VALUE val)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+    long num = -1;
+
+    rb_check_frozen(self);
+    if (!NIL_P(val)) {
+        num = NUM2LONG(val);
+        if (num < 0) {
+            rb_raise(rb_eArgError, "max_waiters must not be negative");
+        }
+    }
+    voice->queue.max_waiters = num;
+    return val;
+}
+
+/*
+ *  Returns the maximum number of waiting calls or nil.
+ *
+ *  @return [Integer, nil]
+ *  @see #max_waiters=
+ */
+static VALUE
+rbflite_voice_get_max_waiters(VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+
+    return (voice->queue.max_waiters >= 0) ? LONG2NUM(voice->queue.max_waiters) : Qnil;
+}
+
+/*
+ * @overload max_wait=(sec)
+ *
+ *  Sets the maximum seconds a call waits for the voice used by
+ *  another call. When it elapses, {Flite::BusyError} is raised.
+ *  nil, the default, means waiting forever. This doesn't limit
+ *  synthesis time. Use <code>:timeout</code> of {#to_speech} for it.
+ *
+ *  @param [Float, nil] sec
+ */
+static VALUE
+rbflite_voice_set_max_wait(VALUE self, VALUE val)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+    double sec = -1;
+
+    rb_check_frozen(self);
+    if (!NIL_P(val)) {
+        sec = NUM2DBL(val);
+        if (!(sec >= 0)) {
+            rb_raise(rb_eArgError, "max_wait must not be negative");
+        }
+    }
+    voice->queue.max_wait = sec;
+    return val;
+}
+
+/*
+ *  Returns the maximum seconds to wait for the voice or nil.
+ *
+ *  @return [Float, nil]
+ *  @see #max_wait=
+ */
+static VALUE
+rbflite_voice_get_max_wait(VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+
+    return (voice->queue.max_wait >= 0) ? DBL2NUM(voice->queue.max_wait) : Qnil;
+}
+
+/*
+ *  Returns the number of calls waiting for the voice used by another
+ *  call. It is always 0 for a frozen voice because its calls don't
+ *  wait.
+ *
+ *  @return [Integer]
+ */
+static VALUE
+rbflite_voice_queue_length(VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+
+    return LONG2NUM((voice->queue.length > 0) ? voice->queue.length - 1 : 0);
+}
+
+/*
+ *  Returns true while a call uses the voice and a new call has to
+ *  wait. It is always false for a frozen voice.
+ *
+ *  @example
+ *    # route requests to another worker
+ *    if voice.busy? && voice.queue_length >= 4
+ *      ...
+ *    end
+ *
+ *  @return [Boolean]
+ */
+static VALUE
+rbflite_voice_busy_p(VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+
+    return (voice->queue.head != NULL) ? Qtrue : Qfalse;
+}
+
+/*
+ * @overload initialize(name = nil, opts = {})
  *
  *  Create a new voice specified by <code>name</code>.
  *  If <code>name</code> includes '.' or '/' and ruby flite
@@ -357,17 +1447,50 @@ rbflite_voice_load(void *data)
  *    # Use a lodable voice.
  *    voice = Flite::Voice.new('/path/to/cmu_us_gka.flitevox')
  *
+ *  A voice is registered or read from the file only once. Voices
+ *  created with the same name share the read-only data and have their
+ *  own features. See {Flite.cached_voices}.
+ *
+ *  A frozen voice is shareable between Ractors when ruby flite is
+ *  compiled for CMU Flite 2.0.0 or upper. Each call on it uses its
+ *  own voice instance, so calls don't wait for each other.
+ *
+ *    voice = Ractor.make_shareable(Flite::Voice.new('slt'))
+ *    ractors = texts.map do |text|
+ *      Ractor.new(voice, text) { |v, t| v.to_speech(t, :mp3) }
+ *    end
+ *    mp3s = ractors.map(&:take)
+ *
+ *  Calls on a voice are serialized. <code>:max_waiters</code> and
+ *  <code>:max_wait</code> in <code>opts</code> bound the calls
+ *  waiting for the voice. See {#max_waiters=} and {#max_wait=}.
+ *
+ *    # Fail fast when more than 4 calls are waiting or a call waits
+ *    # more than 0.5 seconds.
+ *    voice = Flite::Voice.new('slt', :max_waiters => 4, :max_wait => 0.5)
+ *
  *  @param [String] name
+ *  @param [Hash] opts
  *  @see Flite.list_builtin_voices
  */
 static VALUE
 rbflite_voice_initialize(int argc, VALUE *argv, VALUE self)
 {
     VALUE name;
+    VALUE opts;
     const rbflite_builtin_voice_t *builtin = rbflite_builtin_voice_list;
     rbflite_voice_t *voice = DATA_PTR(self);
 
-    rb_scan_args(argc, argv, "01", &name);
+    rb_scan_args(argc, argv, "02", &name, &opts);
+    if (argc == 1 && RB_TYPE_P(name, T_HASH)) {
+        opts = name;
+        name = Qnil;
+    }
+    if (!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        rbflite_voice_set_max_waiters(self, rb_hash_aref(opts, ID2SYM(rb_intern("max_waiters"))));
+        rbflite_voice_set_max_wait(self, rb_hash_aref(opts, ID2SYM(rb_intern("max_wait"))));
+    }
     if (!NIL_P(name)) {
         char *voice_name = StringValueCStr(name);
         while (builtin->name != NULL) {
@@ -379,18 +1502,71 @@ rbflite_voice_initialize(int argc, VALUE *argv, VALUE self)
         if (builtin->name == NULL) {
 #ifdef HAVE_FLITE_VOICE_LOAD
             if (strchr(voice_name, '/') != NULL || strchr(voice_name, '.') != NULL) {
+#ifdef HAVE_FEAT_LINK_INTO
+                voice_cache_entry_t *entry = voice_cache_acquire(voice_name, NULL);
+
+                if (entry == NULL) {
+                    cst_voice *v = rb_thread_call_without_gvl(rbflite_voice_load, voice_name, NULL, NULL);
+                    if (v != NULL) {
+                        /* another thread or Ractor may load the voice while the GVL is released. */
+                        entry = voice_cache_acquire(voice_name, v);
+                        if (entry == NULL || entry->voice != v) {
+                            delete_voice(v);
+                        }
+                        if (entry == NULL) {
+                            rb_raise(rb_eNoMemError, "failed to allocate memory");
+                        }
+                    }
+                }
+                RB_GC_GUARD(name);
+                if (entry != NULL) {
+                    rbflite_voice_use_cache_entry(voice, entry);
+                    return self;
+                }
+#else
                 voice->voice = rb_thread_call_without_gvl(rbflite_voice_load, voice_name, NULL, NULL);
                 RB_GC_GUARD(name);
                 if (voice->voice != NULL) {
                     return self;
                 }
+#endif
             }
 #endif
             rb_raise(rb_eArgError, "Unkonw voice %s", voice_name);
         }
     }
+#ifdef HAVE_FEAT_LINK_INTO
+    {
+        voice_cache_entry_t *entry;
+
+        /* The voice is registered only once even when Ractors create it at the same time. */
+        SHARED_LOCK(voice_cache_mutex);
+        entry = voice_cache_lookup(builtin->name);
+        if (entry == NULL) {
+            cst_voice *v;
+
+            *builtin->cached = NULL; /* disable voice caching in libflite.so. */
+            v = builtin->register_(NULL);
+            entry = voice_cache_add(builtin->name, v);
+            if (entry == NULL) {
+                delete_voice(v);
+            }
+        }
+        if (entry != NULL) {
+            entry->refcnt++;
+        }
+        SHARED_UNLOCK(voice_cache_mutex);
+        if (entry == NULL) {
+            rb_raise(rb_eNoMemError, "failed to allocate memory");
+        }
+        rbflite_voice_use_cache_entry(voice, entry);
+    }
+#else
+    SHARED_LOCK(voice_cache_mutex);
     *builtin->cached = NULL; /* disable voice caching in libflite.so. */
     voice->voice = builtin->register_(NULL);
+    SHARED_UNLOCK(voice_cache_mutex);
+#endif
     return self;
 }
 
@@ -398,199 +1574,3188 @@ static void *
 voice_speech_without_gvl(void *data)
 {
     voice_speech_data_t *vsd = (voice_speech_data_t *)data;
-    flite_text_to_speech(vsd->text, vsd->voice, vsd->outtype);
+    float duration;
+
+    PROBE2(synth_start, vsd, vsd->text);
+    duration = flite_text_to_speech(vsd->text, vsd->voice, vsd->outtype);
+    PROBE2(synth_end, vsd, (long)(duration * 1e6));
+    vsd->stats.duration += duration;
     return NULL;
 }
 
-static int
-wav_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+static void *yield_speech_data(void *data);
+
+static void *
+voice_speech_batch_without_gvl(void *data)
 {
-    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    voice_speech_batch_t *vsb = (voice_speech_batch_t *)data;
+    voice_speech_data_t *vsd = &vsb->vsd;
+    float duration;
+    long i;
 
-    if (start == 0) {
-        /* write WAVE file header. */
-        struct {
-            const char riff_id[4];
-            int file_size;
-            const char wave_id[4];
-            const char fmt_id[4];
-            const int fmt_size;
-            const short format;
-            short channels;
-            int samplerate;
-            int bytepersec;
-            short blockalign;
-            short bitswidth;
-            const char data[4];
-            int data_size;
-        } header = {
-            {'R', 'I', 'F', 'F'},
-            0,
-            {'W', 'A', 'V', 'E'},
-            {'f', 'm', 't', ' '},
-            TO_LE4(16),
-            TO_LE2(0x0001),
-            0, 0, 0, 0, 0,
-            {'d', 'a', 't', 'a'},
-            0,
-        };
-        int num_samples = cst_wave_num_samples(w);
-        int num_channels = cst_wave_num_channels(w);
-        int sample_rate = cst_wave_sample_rate(w);
-        int data_size = num_channels * num_samples * sizeof(short);
-
-        header.file_size = TO_LE4(sizeof(header) + data_size - 8);
-        header.channels = TO_LE2(num_channels);
-        header.samplerate = TO_LE2(sample_rate);
-        header.bytepersec = TO_LE4(sample_rate * num_channels * sizeof(short));
-        header.blockalign = TO_LE2(num_channels * sizeof(short));
-        header.bitswidth = TO_LE2(sizeof(short) * 8);
-        header.data_size = TO_LE4(data_size);
-
-        if (add_data(vsd, &header, sizeof(header)) != 0) {
-            return CST_AUDIO_STREAM_STOP;
+    for (i = 0; i < vsb->num_texts; i++) {
+        long num_speech_data = vsd->num_speech_data;
+
+        if (check_interrupt(vsd) != 0) {
+            break;
+        }
+        vsd->text = vsb->texts[i];
+        PROBE2(synth_start, vsd, vsd->text);
+        duration = flite_text_to_speech(vsd->text, vsd->voice, vsd->outtype);
+        PROBE2(synth_end, vsd, (long)(duration * 1e6));
+        vsd->stats.duration += duration;
+        if (vsd->error != RBFLITE_ERROR_SUCCESS || vsd->state != 0) {
+            break;
+        }
+        if (vsb->yield_each) {
+            rb_thread_call_with_gvl(yield_speech_data, vsd);
+            if (vsd->state != 0) {
+                break;
+            }
+        } else {
+            /* The length of each string is set with the GVL after all texts are converted. */
+            vsb->indexes[i] = (vsd->num_speech_data != num_speech_data) ? num_speech_data : -1;
+            vsb->sizes[i] = vsd->used;
+            vsd->speech_data = Qnil;
+            vsd->ptr = NULL;
+            vsd->capa = 0;
+            vsd->used = 0;
         }
+        vsb->done = i + 1;
     }
+    return NULL;
+}
 
-    if (add_data(vsd, &w->samples[start], size * sizeof(short)) != 0) {
-        return CST_AUDIO_STREAM_STOP;
+/*
+ * Sample rate conversion
+ *
+ * The input is upsampled by up, lowpass filtered by a windowed sinc
+ * and downsampled by down. Only the filter phases needed for output
+ * samples are computed. When up is too large, the preceding phase of
+ * RESAMPLER_MAX_PHASES equally spaced phases is used.
+ */
+#define RESAMPLER_MAX_PHASES 512
+#define RESAMPLER_ZERO_CROSSINGS 16 /* on each side of the filter */
+#define RESAMPLER_CUTOFF 0.92 /* relative to the lower Nyquist frequency */
+#define RESAMPLER_MAX_RATE 384000
+
+static int gcd(int a, int b)
+{
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
     }
-    return CST_AUDIO_STREAM_CONT;
+    return a;
 }
 
-static audio_stream_encoder_t wav_encoder = {
-    wav_encoder_cb,
-    NULL,
-    NULL,
-};
+/* returns the sample_rate option or 0 when it isn't set. */
+static int sample_rate_option(VALUE opts)
+{
+    VALUE v;
+    int rate;
 
-static int
-raw_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+    if (!RB_TYPE_P(opts, T_HASH)) {
+        return 0;
+    }
+    v = rb_hash_aref(opts, ID2SYM(rb_intern("sample_rate")));
+    if (NIL_P(v)) {
+        return 0;
+    }
+    rate = NUM2INT(v);
+    if (rate <= 0 || RESAMPLER_MAX_RATE < rate) {
+        rb_raise(rb_eArgError, "sample rate must be between 1 and %d", RESAMPLER_MAX_RATE);
+    }
+    return rate;
+}
+
+/* returns NULL when out of memory. */
+static resampler_t *resampler_new(int out_rate, cst_audio_stream_callback asc)
 {
-    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    resampler_t *rs = calloc(1, sizeof(resampler_t));
 
-    if (add_data(vsd, &w->samples[start], size * sizeof(short)) != 0) {
-        return CST_AUDIO_STREAM_STOP;
+    if (rs != NULL) {
+        rs->asc = asc;
+        rs->out_rate = out_rate;
     }
-    return CST_AUDIO_STREAM_CONT;
+    return rs;
 }
 
-static audio_stream_encoder_t raw_encoder = {
-    raw_encoder_cb,
-    NULL,
-    NULL,
-};
+static void resampler_free(resampler_t *rs)
+{
+    if (rs != NULL) {
+        free(rs->coefs);
+        free(rs->hist);
+        free(rs->wave.samples);
+        free(rs);
+    }
+}
 
-#ifdef HAVE_MP3LAME
+static int resampler_reserve_hist(resampler_t *rs, size_t len)
+{
+    if (rs->hist_capa < len) {
+        size_t capa = MAX(len, rs->hist_capa * 2);
+        float *hist = realloc(rs->hist, capa * sizeof(float));
 
-#define MAX_SAMPLE_SIZE 1024
-/* "mp3buf_size in bytes = 1.25*num_samples + 7200" according to lame.h. */
-#define MP3BUF_SIZE  (MAX_SAMPLE_SIZE + MAX_SAMPLE_SIZE / 4 + 7200)
-static int mp3_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+        if (hist == NULL) {
+            return -1;
+        }
+        rs->hist = hist;
+        rs->hist_capa = capa;
+    }
+    return 0;
+}
+
+static double blackman_window(double x)
 {
-    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
-    lame_global_flags *gf = vsd->encoder;
-    unsigned char mp3buf[MP3BUF_SIZE];
-    short *sptr = &w->samples[start];
-    short *eptr = sptr + size;
-    int rv;
+    return 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2 * M_PI * x);
+}
 
-    if (start == 0) {
-        lame_set_num_samples(gf, cst_wave_num_samples(w));
-        lame_set_in_samplerate(gf, cst_wave_sample_rate(w));
-        lame_set_num_channels(gf, 1);
-        lame_set_mode(gf, MONO);
-        rv = lame_init_params(gf);
-        if (rv == -1) {
-            vsd->error = RBFLITE_ERROR_LAME_INIT_PARAMS;
-            return CST_AUDIO_STREAM_STOP;
+/* designs the filter for the sample rate of the input. */
+static int resampler_init_filter(resampler_t *rs, int in_rate)
+{
+    int g = gcd(in_rate, rs->out_rate);
+    double cutoff;
+    int p, k;
+
+    rs->in_rate = in_rate;
+    rs->up = rs->out_rate / g;
+    rs->down = in_rate / g;
+    rs->num_phases = MIN(rs->up, RESAMPLER_MAX_PHASES);
+    cutoff = RESAMPLER_CUTOFF * MIN(1.0, (double)rs->up / rs->down);
+    rs->half = (int)ceil(RESAMPLER_ZERO_CROSSINGS / cutoff);
+    rs->num_taps = (2 * rs->half + 3) & ~3;
+    if (rs->coefs_capa < rs->num_phases * rs->num_taps) {
+        free(rs->coefs);
+        rs->coefs_capa = rs->num_phases * rs->num_taps;
+        rs->coefs = malloc(rs->coefs_capa * sizeof(float));
+        if (rs->coefs == NULL) {
+            rs->coefs_capa = 0;
+            return -1;
         }
     }
+    for (p = 0; p < rs->num_phases; p++) {
+        float *h = rs->coefs + p * rs->num_taps;
+        double offset = (double)p / rs->num_phases;
+        double sum = 0;
+
+        for (k = 0; k < rs->num_taps; k++) {
+            /* distance from the output position to the input sample */
+            double d = k - rs->half + 1 - offset;
+            double v = 0;
+
+            if (fabs(d) < rs->half) {
+                double x = M_PI * cutoff * d;
+                v = cutoff * (x == 0 ? 1.0 : sin(x) / x) * blackman_window(d / rs->half);
+            }
+            h[k] = (float)v;
+            sum += v;
+        }
+        /* make the gain at DC exactly 1. */
+        for (k = 0; k < rs->num_taps; k++) {
+            h[k] = (float)(h[k] / sum);
+        }
+    }
+    return 0;
+}
+
+/* starts a new stream. w contains the whole input audio data. */
+static int resampler_start(resampler_t *rs, const cst_wave *w)
+{
+    int in_rate = cst_wave_sample_rate(w);
+    size_t num_samples;
+
+    rs->passthrough = (in_rate == rs->out_rate || in_rate <= 0 || cst_wave_num_channels(w) != 1);
+    if (rs->passthrough) {
+        return 0;
+    }
+    if (in_rate != rs->in_rate && resampler_init_filter(rs, in_rate) != 0) {
+        return -1;
+    }
+    num_samples = ((uint64_t)cst_wave_num_samples(w) * rs->up + rs->down - 1) / rs->down;
+    if (num_samples > INT_MAX) {
+        return -1;
+    }
+    if (rs->wave_capa < num_samples) {
+        short *samples = realloc(rs->wave.samples, MAX(num_samples, 1) * sizeof(short));
+
+        if (samples == NULL) {
+            return -1;
+        }
+        rs->wave.samples = samples;
+        rs->wave_capa = num_samples;
+    }
+    rs->wave.type = w->type;
+    rs->wave.sample_rate = rs->out_rate;
+    rs->wave.num_samples = (int)num_samples;
+    rs->wave.num_channels = 1;
+    rs->out_len = 0;
+    rs->out_sent = 0;
+
+    /* The first output sample is at the first input sample. */
+    if (resampler_reserve_hist(rs, rs->half) != 0) {
+        return -1;
+    }
+    memset(rs->hist, 0, (rs->half - 1) * sizeof(float));
+    rs->hist_len = rs->half - 1;
+    rs->pos = rs->half - 1;
+    rs->frac = 0;
+    return 0;
+}
+
+static float resampler_dot(const float *x, const float *h, int n)
+{
+    int i;
+#ifdef __SSE2__
+    __m128 acc = _mm_setzero_ps();
+
+    for (i = 0; i < n; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc);
+#else
+    float acc[4] = {0, 0, 0, 0};
+
+    for (i = 0; i < n; i += 4) {
+        acc[0] += x[i + 0] * h[i + 0];
+        acc[1] += x[i + 1] * h[i + 1];
+        acc[2] += x[i + 2] * h[i + 2];
+        acc[3] += x[i + 3] * h[i + 3];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+}
+
+/* computes output samples available from the input history. */
+static void resampler_run(resampler_t *rs)
+{
+    short *out = rs->wave.samples;
+    int out_len = rs->out_len;
+    int num_samples = rs->wave.num_samples;
+    size_t pos = rs->pos;
+    int frac = rs->frac;
+    size_t drop;
+
+    while (out_len < num_samples && pos + rs->num_taps - rs->half + 1 <= rs->hist_len) {
+        int phase = (rs->num_phases == rs->up) ? frac : (int)((int64_t)frac * rs->num_phases / rs->up);
+        float v = resampler_dot(rs->hist + pos - rs->half + 1, rs->coefs + phase * rs->num_taps, rs->num_taps);
+
+        if (v >= 32767.0f) {
+            out[out_len++] = 32767;
+        } else if (v <= -32768.0f) {
+            out[out_len++] = -32768;
+        } else {
+            out[out_len++] = (short)lrintf(v);
+        }
+        frac += rs->down;
+        pos += frac / rs->up;
+        frac %= rs->up;
+    }
+    rs->out_len = out_len;
+    rs->frac = frac;
+
+    /* discard input samples which are no longer needed. */
+    drop = MIN(pos - rs->half + 1, rs->hist_len);
+    memmove(rs->hist, rs->hist + drop, (rs->hist_len - drop) * sizeof(float));
+    rs->hist_len -= drop;
+    rs->pos = pos - drop;
+}
+
+/*
+ * Audio stream callback which converts the sample rate and passes
+ * the resampled audio data to rs->asc.
+ */
+static int
+resampler_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    resampler_t *rs = vsd->resampler;
+    const short *sptr = &w->samples[start];
+    int i;
+
+    if (start == 0 && resampler_start(rs, w) != 0) {
+        vsd->error = RBFLITE_ERROR_OUT_OF_MEMORY;
+        return CST_AUDIO_STREAM_STOP;
+    }
+    if (rs->passthrough) {
+        return rs->asc(w, start, size, last, last_arg);
+    }
+
+    /* Zeros after the last sample flush the filter. */
+    if (resampler_reserve_hist(rs, rs->hist_len + size + (last ? rs->num_taps : 0)) != 0) {
+        vsd->error = RBFLITE_ERROR_OUT_OF_MEMORY;
+        return CST_AUDIO_STREAM_STOP;
+    }
+    for (i = 0; i < size; i++) {
+        rs->hist[rs->hist_len++] = sptr[i];
+    }
+    if (last) {
+        memset(rs->hist + rs->hist_len, 0, rs->num_taps * sizeof(float));
+        rs->hist_len += rs->num_taps;
+    }
+    resampler_run(rs);
+    if (last) {
+        while (rs->out_len < rs->wave.num_samples) {
+            rs->wave.samples[rs->out_len++] = 0;
+        }
+    } else if (rs->out_len == rs->out_sent) {
+        return CST_AUDIO_STREAM_CONT;
+    }
+    start = rs->out_sent;
+    rs->out_sent = rs->out_len;
+    return rs->asc(&rs->wave, start, rs->out_len - start, last, last_arg);
+}
+
+/*
+ * Audio stream callback passed to flite. It stops synthesis when
+ * the calling thread is interrupted or the timeout expires.
+ */
+static int
+stream_guard_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    double start_time;
+    int rv;
+
+    if (check_interrupt(vsd) != 0) {
+        return CST_AUDIO_STREAM_STOP;
+    }
+    PROBE2(chunk_start, vsd, size);
+    start_time = monotonic_time();
+    rv = vsd->stream_asc(w, start, size, last, last_arg);
+    vsd->stats.encode_time += monotonic_time() - start_time;
+    PROBE3(chunk_encoded, vsd, size, vsd->num_bytes);
+    return rv;
+}
+
+#ifdef HAVE_PARALLEL_SPEECH
+static int
+num_processors(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n > 0) ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Splits text at sentence boundaries into at most max_pieces pieces
+ * of similar length. offsets[i] is set to the start position of the
+ * i-th piece and offsets[n] to the text length, where n is the return
+ * value. Pieces shorter than MIN_SPEECH_PIECE_LEN aren't made.
+ */
+static int
+split_text(const char *text, long len, int max_pieces, long *offsets)
+{
+    long piece_len = MAX(len / max_pieces, MIN_SPEECH_PIECE_LEN);
+    int n = 0;
+    long pos;
+
+    offsets[n++] = 0;
+    for (pos = 1; pos < len && n < max_pieces; pos++) {
+        char c = text[pos - 1];
+
+        /* a period, a question mark, an exclamation mark or a blank line followed by spaces */
+        if ((c == '.' || c == '!' || c == '?' || c == '\n') && ISSPACE(text[pos])) {
+            long next = pos;
+
+            while (next < len && ISSPACE(text[next])) {
+                next++;
+            }
+            if (next - offsets[n - 1] >= piece_len && len - next >= MIN_SPEECH_PIECE_LEN) {
+                offsets[n++] = next;
+            }
+            pos = next - 1;
+        }
+    }
+    offsets[n] = len;
+    return n;
+}
+
+static void native_sleep_msec(int msec)
+{
+#if defined(_WIN32)
+    Sleep(msec);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+/* audio stream callback storing audio data of a piece. This runs in a native thread or the calling thread. */
+static int
+speech_piece_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    speech_piece_t *piece = (speech_piece_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+
+    if (piece->in_caller ? check_interrupt(piece->vsd) != 0 : speech_interrupted(piece->vsd)) {
+        return CST_AUDIO_STREAM_STOP;
+    }
+    if (start == 0) {
+        piece->sample_rate = cst_wave_sample_rate(w);
+        piece->num_channels = cst_wave_num_channels(w);
+    }
+    if (piece->num_samples + size > piece->capa) {
+        size_t capa = MAX(piece->capa * 2, (size_t)cst_wave_num_samples(w));
+        short *samples;
+
+        capa = MAX(capa, piece->num_samples + size);
+        samples = realloc(piece->samples, capa * sizeof(short));
+        if (samples == NULL) {
+            piece->error = 1;
+            return CST_AUDIO_STREAM_STOP;
+        }
+        piece->samples = samples;
+        piece->capa = capa;
+    }
+    memcpy(piece->samples + piece->num_samples, &w->samples[start], size * sizeof(short));
+    piece->num_samples += size;
+    return CST_AUDIO_STREAM_CONT;
+}
+
+NATIVE_THREAD_FUNC(speech_piece_synthesize, arg)
+{
+    speech_piece_t *piece = (speech_piece_t *)arg;
+    double cpu_time = thread_cpu_time();
+
+    PROBE2(synth_start, piece->vsd, piece->text);
+    piece->duration = flite_text_to_speech(piece->text, piece->voice, "stream");
+    PROBE2(synth_end, piece->vsd, (long)(piece->duration * 1e6));
+    piece->cpu_time = thread_cpu_time() - cpu_time;
+    piece->finished = 1;
+    NATIVE_THREAD_RETURN;
+}
+
+/* prepares a voice instance and a NUL-terminated text for a piece. */
+static int
+speech_piece_init(speech_piece_t *piece, const cst_voice *voice, const char *text, long len)
+{
+    cst_audio_streaming_info *asi;
+
+    piece->text = malloc(len + 1);
+    if (piece->text == NULL) {
+        return -1;
+    }
+    memcpy(piece->text, text, len);
+    piece->text[len] = '\0';
+
+    asi = new_audio_streaming_info();
+    if (asi == NULL) {
+        return -1;
+    }
+    asi->asc = speech_piece_cb;
+    asi->userdata = piece;
+    piece->voice = voice_instance_new(voice);
+    flite_feat_set(piece->voice->features, "streaming_info", audio_streaming_info_val(asi));
+    return 0;
+}
+
+/*
+ * Synthesizes pieces of vsd->text concurrently by native threads
+ * and passes the concatenated audio data to the encoder as if
+ * they were synthesized at once. Each thread uses its own voice
+ * instance sharing read-only voice data.
+ */
+static void *
+voice_speech_parallel_without_gvl(void *data)
+{
+    voice_speech_parallel_t *vsp = (voice_speech_parallel_t *)data;
+    voice_speech_data_t *vsd = vsp->vsd;
+    int num_pieces = vsp->num_pieces;
+    speech_piece_t *pieces = calloc(num_pieces, sizeof(speech_piece_t));
+    size_t total = 0;
+    short *samples;
+    int i;
+
+    if (pieces == NULL) {
+        vsd->error = RBFLITE_ERROR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    for (i = 0; i < num_pieces; i++) {
+        speech_piece_t *piece = &pieces[i];
+        long offset = vsp->offsets[i];
+
+        piece->vsd = vsd;
+        if (speech_piece_init(piece, vsp->voice, vsd->text + offset, vsp->offsets[i + 1] - offset) != 0) {
+            piece->error = 1;
+        } else if (i > 0 && native_thread_create(&piece->thread, speech_piece_synthesize, piece) == 0) {
+            piece->started = 1;
+        }
+    }
+    /* The first piece and pieces whose threads cannot be created are synthesized by this thread. */
+    for (i = 0; i < num_pieces; i++) {
+        speech_piece_t *piece = &pieces[i];
+
+        if (piece->started) {
+            /* interrupts are checked while waiting because joining cannot be unblocked. */
+            while (!piece->finished) {
+                check_interrupt(vsd);
+                native_sleep_msec(10);
+            }
+            native_thread_join(piece->thread);
+            /* CPU time of this thread is counted by speech_call(). */
+            vsd->stats.cpu_time += piece->cpu_time;
+        } else if (!piece->error) {
+            piece->in_caller = 1;
+            speech_piece_synthesize(piece);
+        }
+        vsd->stats.duration += piece->duration;
+        if (piece->voice != NULL) {
+            delete_voice(piece->voice);
+        }
+        free(piece->text);
+        if (piece->error) {
+            vsd->error = RBFLITE_ERROR_OUT_OF_MEMORY;
+        }
+        total += piece->num_samples;
+    }
+
+    /* concatenate audio data into the buffer of the first piece. */
+    samples = NULL;
+    if (check_interrupt(vsd) == 0 && vsd->error == RBFLITE_ERROR_SUCCESS && total > 0) {
+        samples = realloc(pieces[0].samples, total * sizeof(short));
+        if (samples != NULL) {
+            pieces[0].samples = samples;
+            total = pieces[0].num_samples;
+            for (i = 1; i < num_pieces; i++) {
+                memcpy(samples + total, pieces[i].samples, pieces[i].num_samples * sizeof(short));
+                total += pieces[i].num_samples;
+            }
+        } else {
+            vsd->error = RBFLITE_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    if (samples != NULL) {
+        cst_audio_stream_callback asc = stream_guard_cb;
+        cst_wave w;
+        asc_last_arg_t last_arg;
+        size_t start;
+#ifdef HAVE_CST_AUDIO_STREAMING_INFO_UTT
+        cst_audio_streaming_info asi;
+
+        memset(&asi, 0, sizeof(asi));
+        asi.asc = asc;
+        asi.userdata = vsd;
+        last_arg = &asi;
+#else
+        last_arg = vsd;
+#endif
+        memset(&w, 0, sizeof(w));
+        w.sample_rate = pieces[0].sample_rate;
+        w.num_channels = pieces[0].num_channels;
+        w.num_samples = (int)total;
+        w.samples = samples;
+        for (i = 1; w.sample_rate == 0 && i < num_pieces; i++) {
+            /* the first piece may have no audio data. */
+            w.sample_rate = pieces[i].sample_rate;
+            w.num_channels = pieces[i].num_channels;
+        }
+        for (start = 0; start < total; start += SPEECH_PIECE_CHUNK_SIZE) {
+            int size = (int)MIN(total - start, SPEECH_PIECE_CHUNK_SIZE);
+
+            if (asc(&w, (int)start, size, start + size == total, last_arg) != CST_AUDIO_STREAM_CONT) {
+                break;
+            }
+        }
+    }
+    for (i = 0; i < num_pieces; i++) {
+        free(pieces[i].samples);
+    }
+    free(pieces);
+    return NULL;
+}
+#endif
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_ALAW 0x0006
+#define WAVE_FORMAT_MULAW 0x0007
+
+static void put_le2(unsigned char *p, int val)
+{
+    p[0] = (unsigned char)val;
+    p[1] = (unsigned char)(val >> 8);
+}
+
+static void put_le4(unsigned char *p, int val)
+{
+    p[0] = (unsigned char)val;
+    p[1] = (unsigned char)(val >> 8);
+    p[2] = (unsigned char)(val >> 16);
+    p[3] = (unsigned char)(val >> 24);
+}
+
+/* sets the sizes in the header for data_size bytes of audio data. */
+static void
+wav_header_set_data_size(wav_header_t *header, int data_size)
+{
+    header->data_size = data_size;
+    put_le4(header->bytes + 4, header->size + data_size - 8);
+    if (header->size == WAV_HEADER_EXT_SIZE) {
+        /* number of samples per channel in the fact chunk */
+        put_le4(header->bytes + 46, data_size / header->block_align);
+    }
+    put_le4(header->bytes + header->size - 4, data_size);
+}
+
+static void
+wav_header_init(wav_header_t *header, int format, int num_channels, int sample_rate, int bytes_per_sample, int data_size)
+{
+    unsigned char *p = header->bytes;
+    int ext = (format != WAVE_FORMAT_PCM);
+
+    header->size = ext ? WAV_HEADER_EXT_SIZE : WAV_HEADER_SIZE;
+    header->block_align = num_channels * bytes_per_sample;
+    memcpy(p, "RIFF", 4);
+    memcpy(p + 8, "WAVE", 4);
+    memcpy(p + 12, "fmt ", 4);
+    put_le4(p + 16, ext ? 18 : 16);
+    put_le2(p + 20, format);
+    put_le2(p + 22, num_channels);
+    put_le4(p + 24, sample_rate);
+    put_le4(p + 28, sample_rate * header->block_align);
+    put_le2(p + 32, header->block_align);
+    put_le2(p + 34, bytes_per_sample * 8);
+    if (ext) {
+        put_le2(p + 36, 0); /* cbSize */
+        memcpy(p + 38, "fact", 4);
+        put_le4(p + 42, 4);
+    }
+    memcpy(p + header->size - 8, "data", 4);
+    wav_header_set_data_size(header, data_size);
+}
+
+/* returns nonzero when fd is opened in append mode, where pwrite() appends data. */
+static int fd_is_append(int fd)
+{
+#if defined(F_GETFL) && defined(O_APPEND)
+    int flags = fcntl(fd, F_GETFL);
+
+    return flags != -1 && (flags & O_APPEND) != 0;
+#else
+    return 0;
+#endif
+}
+
+/* writes WAVE file header for the audio data in w. */
+static int
+wav_write_header(voice_speech_data_t *vsd, const cst_wave *w, int format, int bytes_per_sample)
+{
+    int num_channels = cst_wave_num_channels(w);
+    int data_size = num_channels * cst_wave_num_samples(w) * bytes_per_sample;
+
+    wav_header_init(&vsd->wav_header, format, num_channels, cst_wave_sample_rate(w), bytes_per_sample, data_size);
+    if (reserve_data(vsd, vsd->wav_header.size + data_size) != 0) {
+        return -1;
+    }
+    if (vsd->fd != -1 && !fd_is_append(vsd->fd)) {
+        /* remember the position to fix the header after synthesis. */
+        vsd->wav_header_offset = lseek(vsd->fd, 0, SEEK_CUR);
+    }
+    return add_data(vsd, vsd->wav_header.bytes, vsd->wav_header.size);
+}
+
+/*
+ * Sample formats of :wav and :raw. 16-bit samples are converted to
+ * 24-bit integers or 32-bit floating point numbers in [-1.0, 1.0).
+ */
+#define PCM_CHUNK_SIZE 1024 /* number of samples converted at once */
+
+enum pcm_format {
+    PCM_INT16,
+    PCM_INT24,
+    PCM_FLOAT32,
+};
+
+typedef struct {
+    enum pcm_format format;
+    int bytes_per_sample;
+    int swap; /* nonzero when the byte order differs from the host's */
+    unsigned char buf[PCM_CHUNK_SIZE * 4];
+} pcm_encoder_t;
+
+#ifdef __SSE2__
+static __m128i swap16_sse2(__m128i x)
+{
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+static __m128i swap32_sse2(__m128i x)
+{
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+    x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+    return swap16_sse2(x);
+}
+#endif
+
+/* copies samples in the opposite byte order of this machine. */
+static void pcm_encode_int16(const short *src, unsigned char *dest, int size)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 8 <= size; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i * 2), swap16_sse2(x));
+    }
+#endif
+    for (; i < size; i++) {
+        unsigned short v = (unsigned short)src[i];
+
+        v = (unsigned short)((v >> 8) | (v << 8));
+        memcpy(dest + i * 2, &v, 2);
+    }
+}
+
+static void pcm_encode_int24(const short *src, unsigned char *dest, int size, int big_endian)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        unsigned short v = (unsigned short)src[i];
+        unsigned char *d = dest + i * 3;
+
+        if (big_endian) {
+            d[0] = (unsigned char)(v >> 8);
+            d[1] = (unsigned char)v;
+            d[2] = 0;
+        } else {
+            d[0] = 0;
+            d[1] = (unsigned char)v;
+            d[2] = (unsigned char)(v >> 8);
+        }
+    }
+}
+
+static void pcm_encode_float32(const short *src, unsigned char *dest, int size, int swap)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+
+    for (; i + 8 <= size; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        /* sign-extend to 32-bit integers */
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        __m128i f0 = _mm_castps_si128(_mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        __m128i f1 = _mm_castps_si128(_mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+
+        if (swap) {
+            f0 = swap32_sse2(f0);
+            f1 = swap32_sse2(f1);
+        }
+        _mm_storeu_si128((__m128i *)(dest + i * 4), f0);
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 16), f1);
+    }
+#endif
+    for (; i < size; i++) {
+        float f = src[i] * (1.0f / 32768.0f);
+        uint32_t v;
+
+        memcpy(&v, &f, 4);
+        if (swap) {
+            v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+        }
+        memcpy(dest + i * 4, &v, 4);
+    }
+}
+
+/* converts samples to the sample format and adds them to vsd. */
+static int pcm_add_samples(voice_speech_data_t *vsd, pcm_encoder_t *enc, const short *sptr, int size)
+{
+    if (enc->format == PCM_INT16 && !enc->swap) {
+        return add_data(vsd, sptr, size * sizeof(short));
+    }
+    while (size > 0) {
+        int n = MIN(size, PCM_CHUNK_SIZE);
+
+        switch (enc->format) {
+        case PCM_INT16:
+            pcm_encode_int16(sptr, enc->buf, n);
+            break;
+        case PCM_INT24:
+#ifdef WORDS_BIGENDIAN
+            pcm_encode_int24(sptr, enc->buf, n, !enc->swap);
+#else
+            pcm_encode_int24(sptr, enc->buf, n, enc->swap);
+#endif
+            break;
+        case PCM_FLOAT32:
+            pcm_encode_float32(sptr, enc->buf, n, enc->swap);
+            break;
+        }
+        if (add_data(vsd, enc->buf, n * enc->bytes_per_sample) != 0) {
+            return -1;
+        }
+        sptr += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static pcm_encoder_t *pcm_encoder_init(VALUE opts, int wav)
+{
+    pcm_encoder_t *enc;
+    enum pcm_format format = PCM_INT16;
+    int big_endian;
+
+#ifdef WORDS_BIGENDIAN
+    big_endian = !wav;
+#else
+    big_endian = 0;
+#endif
+    if (!NIL_P(opts)) {
+        VALUE v;
+        Check_Type(opts, T_HASH);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("format")));
+        if (!NIL_P(v)) {
+            if (rb_equal(v, ID2SYM(rb_intern("int16")))) {
+                format = PCM_INT16;
+            } else if (rb_equal(v, ID2SYM(rb_intern("int24")))) {
+                format = PCM_INT24;
+            } else if (rb_equal(v, ID2SYM(rb_intern("float32")))) {
+                format = PCM_FLOAT32;
+            } else {
+                rb_raise(rb_eArgError, "format must be :int16, :int24 or :float32");
+            }
+        }
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("endian")));
+        if (!NIL_P(v)) {
+            if (rb_equal(v, ID2SYM(rb_intern("little")))) {
+                big_endian = 0;
+            } else if (rb_equal(v, ID2SYM(rb_intern("big")))) {
+                big_endian = 1;
+            } else if (rb_equal(v, ID2SYM(rb_intern("native")))) {
+#ifdef WORDS_BIGENDIAN
+                big_endian = 1;
+#else
+                big_endian = 0;
+#endif
+            } else {
+                rb_raise(rb_eArgError, "endian must be :little, :big or :native");
+            }
+            if (wav && big_endian) {
+                rb_raise(rb_eArgError, "audio data in WAVE files must be little endian");
+            }
+        }
+    }
+
+    enc = ALLOC(pcm_encoder_t);
+    enc->format = format;
+    enc->bytes_per_sample = (format == PCM_INT16) ? 2 : (format == PCM_INT24) ? 3 : 4;
+#ifdef WORDS_BIGENDIAN
+    enc->swap = !big_endian;
+#else
+    enc->swap = big_endian;
+#endif
+    return enc;
+}
+
+static int
+wav_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    pcm_encoder_t *enc = vsd->encoder;
+
+    if (start == 0) {
+        int format = (enc->format == PCM_FLOAT32) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+        if (wav_write_header(vsd, w, format, enc->bytes_per_sample) != 0) {
+            return CST_AUDIO_STREAM_STOP;
+        }
+    }
+
+    if (pcm_add_samples(vsd, enc, &w->samples[start], size) != 0) {
+        return CST_AUDIO_STREAM_STOP;
+    }
+    return CST_AUDIO_STREAM_CONT;
+}
+
+static void *wav_encoder_init(VALUE opts)
+{
+    return pcm_encoder_init(opts, 1);
+}
+
+static void pcm_encoder_fini(void *encoder)
+{
+    xfree(encoder);
+}
+
+static audio_stream_encoder_t wav_encoder = {
+    wav_encoder_cb,
+    wav_encoder_init,
+    pcm_encoder_fini,
+};
+
+static int
+raw_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    pcm_encoder_t *enc = vsd->encoder;
+
+    if (start == 0) {
+        int data_size = cst_wave_num_channels(w) * cst_wave_num_samples(w) * enc->bytes_per_sample;
+        if (reserve_data(vsd, data_size) != 0) {
+            return CST_AUDIO_STREAM_STOP;
+        }
+    }
+    if (pcm_add_samples(vsd, enc, &w->samples[start], size) != 0) {
+        return CST_AUDIO_STREAM_STOP;
+    }
+    return CST_AUDIO_STREAM_CONT;
+}
+
+static void *raw_encoder_init(VALUE opts)
+{
+    return pcm_encoder_init(opts, 0);
+}
+
+static audio_stream_encoder_t raw_encoder = {
+    raw_encoder_cb,
+    raw_encoder_init,
+    pcm_encoder_fini,
+};
+
+/*
+ * G.711 mu-law and A-law encoders. 16-bit samples are compressed
+ * to 8-bit codes in the same way as linear_to_ulaw() and
+ * linear_to_alaw() in spandsp.
+ */
+#define G711_CHUNK_SIZE 4096
+
+typedef struct {
+    int alaw; /* nonzero for A-law, zero for mu-law */
+    int wav; /* nonzero when the audio data is wrapped in WAVE format */
+    unsigned char buf[G711_CHUNK_SIZE];
+} g711_encoder_t;
+
+/* returns the position of the highest bit set in val | 0xff minus 7. */
+static int g711_segment(int val)
+{
+    int seg = 0;
+
+    val >>= 8;
+    while (val != 0) {
+        seg++;
+        val >>= 1;
+    }
+    return seg;
+}
+
+static unsigned char linear_to_ulaw(int linear)
+{
+    int mask;
+    int seg;
+
+    if (linear < 0) {
+        linear = 0x84 - linear;
+        mask = 0x7f;
+    } else {
+        linear = 0x84 + linear;
+        mask = 0xff;
+    }
+    seg = g711_segment(linear);
+    if (seg >= 8) {
+        return 0x7f ^ mask;
+    }
+    return ((seg << 4) | ((linear >> (seg + 3)) & 0x0f)) ^ mask;
+}
+
+static unsigned char linear_to_alaw(int linear)
+{
+    int mask;
+    int seg;
+
+    if (linear >= 0) {
+        mask = 0xd5;
+    } else {
+        mask = 0x55;
+        linear = -linear - 1;
+    }
+    seg = g711_segment(linear);
+    return ((seg << 4) | ((linear >> (seg ? seg + 3 : 4)) & 0x0f)) ^ mask;
+}
+
+#ifdef __SSE2__
+/*
+ * Converts 8 samples at once. The segment is the number of thresholds
+ * the magnitude exceeds, and the variable right shift to get the
+ * mantissa is done by multiplying by 2^(16 - shift) and taking the
+ * high 16 bits.
+ */
+static __m128i ulaw_encode_sse2(__m128i x)
+{
+    __m128i sign = _mm_srai_epi16(x, 15);
+    /* 0x84 + |x|, which is up to 0x8084 and treated as unsigned. */
+    __m128i linear = _mm_add_epi16(_mm_sub_epi16(_mm_xor_si128(x, sign), sign), _mm_set1_epi16(0x84));
+    __m128i seg = _mm_setzero_si128();
+    __m128i mul = _mm_set1_epi16(1 << 13);
+    __m128i mask = _mm_xor_si128(_mm_set1_epi16(0xff), _mm_and_si128(sign, _mm_set1_epi16(0x80)));
+    __m128i code;
+    int t;
+
+    /* saturate to 0x7fff, whose code is the same as ones of larger values. */
+    linear = _mm_sub_epi16(linear, _mm_subs_epu16(linear, _mm_set1_epi16(0x7fff)));
+    for (t = 8; t <= 14; t++) {
+        __m128i ge = _mm_cmpgt_epi16(linear, _mm_set1_epi16((1 << t) - 1));
+        seg = _mm_sub_epi16(seg, ge);
+        mul = _mm_sub_epi16(mul, _mm_and_si128(_mm_srli_epi16(mul, 1), ge));
+    }
+    code = _mm_and_si128(_mm_mulhi_epu16(linear, mul), _mm_set1_epi16(0x0f));
+    code = _mm_or_si128(code, _mm_slli_epi16(seg, 4));
+    return _mm_xor_si128(code, mask);
+}
+
+static __m128i alaw_encode_sse2(__m128i x)
+{
+    __m128i sign = _mm_srai_epi16(x, 15);
+    /* x for positive values, -x - 1 for negative values */
+    __m128i linear = _mm_xor_si128(x, sign);
+    __m128i seg = _mm_setzero_si128();
+    __m128i mul = _mm_set1_epi16(1 << 12);
+    __m128i mask = _mm_xor_si128(_mm_set1_epi16(0xd5), _mm_and_si128(sign, _mm_set1_epi16(0x80)));
+    __m128i code;
+    int t;
+
+    for (t = 8; t <= 14; t++) {
+        __m128i ge = _mm_cmpgt_epi16(linear, _mm_set1_epi16((1 << t) - 1));
+        seg = _mm_sub_epi16(seg, ge);
+        if (t > 8) {
+            /* The shift is 4 for both segment 0 and 1. */
+            mul = _mm_sub_epi16(mul, _mm_and_si128(_mm_srli_epi16(mul, 1), ge));
+        }
+    }
+    code = _mm_and_si128(_mm_mulhi_epu16(linear, mul), _mm_set1_epi16(0x0f));
+    code = _mm_or_si128(code, _mm_slli_epi16(seg, 4));
+    return _mm_xor_si128(code, mask);
+}
+#endif
+
+static void g711_encode(const short *src, unsigned char *dest, int size, int alaw)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        __m128i x0 = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        __m128i y;
+
+        if (alaw) {
+            y = _mm_packus_epi16(alaw_encode_sse2(x0), alaw_encode_sse2(x1));
+        } else {
+            y = _mm_packus_epi16(ulaw_encode_sse2(x0), ulaw_encode_sse2(x1));
+        }
+        _mm_storeu_si128((__m128i *)(dest + i), y);
+    }
+#endif
+    for (; i < size; i++) {
+        dest[i] = alaw ? linear_to_alaw(src[i]) : linear_to_ulaw(src[i]);
+    }
+}
+
+static int
+g711_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    g711_encoder_t *enc = vsd->encoder;
+    const short *sptr = &w->samples[start];
+
+    if (start == 0) {
+        if (enc->wav) {
+            if (wav_write_header(vsd, w, enc->alaw ? WAVE_FORMAT_ALAW : WAVE_FORMAT_MULAW, 1) != 0) {
+                return CST_AUDIO_STREAM_STOP;
+            }
+        } else {
+            if (reserve_data(vsd, cst_wave_num_channels(w) * cst_wave_num_samples(w)) != 0) {
+                return CST_AUDIO_STREAM_STOP;
+            }
+        }
+    }
+    while (size > 0) {
+        int n = MIN(size, G711_CHUNK_SIZE);
+
+        g711_encode(sptr, enc->buf, n, enc->alaw);
+        if (add_data(vsd, enc->buf, n) != 0) {
+            return CST_AUDIO_STREAM_STOP;
+        }
+        sptr += n;
+        size -= n;
+    }
+    return CST_AUDIO_STREAM_CONT;
+}
+
+static void *g711_encoder_init(VALUE opts, int alaw)
+{
+    g711_encoder_t *enc;
+    int wav = 0;
+
+    if (!NIL_P(opts)) {
+        VALUE v;
+        Check_Type(opts, T_HASH);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("container")));
+        if (!NIL_P(v)) {
+            if (rb_equal(v, sym_wav)) {
+                wav = 1;
+            } else if (!rb_equal(v, sym_raw)) {
+                rb_raise(rb_eArgError, "container must be :wav or :raw");
+            }
+        }
+    }
+
+    enc = ALLOC(g711_encoder_t);
+    enc->alaw = alaw;
+    enc->wav = wav;
+    return enc;
+}
+
+static void *ulaw_encoder_init(VALUE opts)
+{
+    return g711_encoder_init(opts, 0);
+}
+
+static void *alaw_encoder_init(VALUE opts)
+{
+    return g711_encoder_init(opts, 1);
+}
+
+static void g711_encoder_fini(void *encoder)
+{
+    xfree(encoder);
+}
+
+static audio_stream_encoder_t ulaw_encoder = {
+    g711_encoder_cb,
+    ulaw_encoder_init,
+    g711_encoder_fini,
+};
+
+static audio_stream_encoder_t alaw_encoder = {
+    g711_encoder_cb,
+    alaw_encoder_init,
+    g711_encoder_fini,
+};
+
+#ifdef HAVE_MP3LAME
+
+#define MAX_SAMPLE_SIZE 1024
+/* "mp3buf_size in bytes = 1.25*num_samples + 7200" according to lame.h. */
+#define MP3BUF_SIZE  (MAX_SAMPLE_SIZE + MAX_SAMPLE_SIZE / 4 + 7200)
+
+#ifdef HAVE_MP3_PIPELINE
+#define MP3_RING_SIZE (64 * 1024) /* number of samples. This must be a power of two. */
+
+/*
+ * A single-producer/single-consumer ring buffer passing audio data
+ * from the flite thread to the encoder thread. The flite thread
+ * advances tail and the encoder thread advances head. A thread
+ * sleeps on cond only when the ring is full or empty.
+ */
+typedef struct {
+    lame_global_flags *gf;
+    voice_speech_data_t *vsd;
+    voice_speech_data_t *owner; /* vsd->owner, whose interrupts stop the flite thread */
+    native_thread_t thread;
+    native_mutex_t mutex;
+    native_cond_t cond;
+    size_t head; /* number of samples encoded */
+    size_t tail; /* number of samples synthesized */
+    int done; /* nonzero after the last samples are pushed */
+    int producer_waiting; /* nonzero while the flite thread sleeps */
+    int consumer_waiting; /* nonzero while the encoder thread sleeps */
+    int error; /* enum rbfile_error set by the encoder thread */
+    int errnum; /* errno when error is RBFLITE_ERROR_WRITE */
+    size_t written; /* bytes written to vsd->fd by the encoder thread */
+    size_t max_bytes; /* copy of vsd->max_bytes */
+    size_t num_bytes; /* vsd->num_bytes plus the bytes encoded by the encoder thread */
+    unsigned char *out; /* encoded data when they aren't written to vsd->fd */
+    size_t out_len;
+    size_t out_capa;
+    short ring[MP3_RING_SIZE];
+} mp3_pipeline_t;
+#endif
+
+typedef struct {
+    lame_global_flags *gf; /* initialized for sample_rate. NULL before the first audio data. */
+    int sample_rate;
+    int flushed; /* nonzero after lame_encode_flush(). gf can be reused. */
+    int bitrate;
+    int scale;
+    int scale_set;
+    int quality; /* -1 when not set */
+    int pipeline; /* nonzero when encoded by another thread if possible */
+#ifdef HAVE_MP3_PIPELINE
+    int running; /* nonzero while the encoder thread runs */
+    mp3_pipeline_t *pl;
+#endif
+} mp3_encoder_t;
+
+/* create lame_global_flags with the encoder options. This doesn't need the GVL. */
+static lame_global_flags *mp3_lame_new(const mp3_encoder_t *enc)
+{
+    lame_global_flags *gf = lame_init();
+
+    if (gf == NULL) {
+        return NULL;
+    }
+    lame_set_bWriteVbrTag(gf, 0);
+    lame_set_brate(gf, enc->bitrate);
+    if (enc->scale_set) {
+        lame_set_scale(gf, enc->scale);
+    }
+    if (enc->quality != -1) {
+        lame_set_quality(gf, enc->quality);
+    }
+    return gf;
+}
+
+#ifdef HAVE_MP3_POOL
+/* an idle lame encoder */
+typedef struct mp3_pool_entry {
+    struct mp3_pool_entry *next;
+    lame_global_flags *gf;
+    int sample_rate;
+    int bitrate;
+    int scale;
+    int scale_set;
+    int quality;
+} mp3_pool_entry_t;
+
+static native_mutex_t mp3_pool_mutex;
+static mp3_pool_entry_t *mp3_pool;
+static long mp3_pool_size;
+static long mp3_pool_max_size = 16;
+static unsigned long mp3_pool_hits;
+static unsigned long mp3_pool_misses;
+
+/* takes an idle encoder initialized with the same parameters from the pool. */
+static lame_global_flags *mp3_pool_get(const mp3_encoder_t *enc, int sample_rate)
+{
+    mp3_pool_entry_t **prev = &mp3_pool;
+    mp3_pool_entry_t *entry;
+    lame_global_flags *gf = NULL;
+
+    native_mutex_lock(&mp3_pool_mutex);
+    while ((entry = *prev) != NULL) {
+        if (entry->sample_rate == sample_rate && entry->bitrate == enc->bitrate
+            && entry->quality == enc->quality && entry->scale_set == enc->scale_set
+            && entry->scale == enc->scale) {
+            *prev = entry->next;
+            mp3_pool_size--;
+            gf = entry->gf;
+            break;
+        }
+        prev = &entry->next;
+    }
+    if (gf != NULL) {
+        mp3_pool_hits++;
+    } else {
+        mp3_pool_misses++;
+    }
+    native_mutex_unlock(&mp3_pool_mutex);
+    free(entry);
+    return gf;
+}
+
+/* resets a flushed encoder and puts it to the pool. */
+static void mp3_pool_put(const mp3_encoder_t *enc, lame_global_flags *gf)
+{
+    mp3_pool_entry_t *entry = NULL;
+
+    if (lame_init_bitstream(gf) == 0) {
+        entry = malloc(sizeof(mp3_pool_entry_t));
+    }
+    if (entry != NULL) {
+        entry->gf = gf;
+        entry->sample_rate = enc->sample_rate;
+        entry->bitrate = enc->bitrate;
+        entry->scale = enc->scale;
+        entry->scale_set = enc->scale_set;
+        entry->quality = enc->quality;
+        native_mutex_lock(&mp3_pool_mutex);
+        if (mp3_pool_size < mp3_pool_max_size) {
+            entry->next = mp3_pool;
+            mp3_pool = entry;
+            mp3_pool_size++;
+            gf = NULL;
+        }
+        native_mutex_unlock(&mp3_pool_mutex);
+        if (gf != NULL) {
+            free(entry);
+        }
+    }
+    if (gf != NULL) {
+        lame_close(gf);
+    }
+}
+#endif
+
+/* sets enc->gf initialized for the sample rate. This doesn't need the GVL. */
+static enum rbfile_error mp3_encoder_open(mp3_encoder_t *enc, const cst_wave *w)
+{
+    int sample_rate = cst_wave_sample_rate(w);
+
+    enc->sample_rate = sample_rate;
+    enc->flushed = 0;
+#ifdef HAVE_MP3_POOL
+    enc->gf = mp3_pool_get(enc, sample_rate);
+    if (enc->gf != NULL) {
+        return RBFLITE_ERROR_SUCCESS;
+    }
+#endif
+    enc->gf = mp3_lame_new(enc);
+    if (enc->gf == NULL) {
+        return RBFLITE_ERROR_OUT_OF_MEMORY;
+    }
+    lame_set_num_samples(enc->gf, cst_wave_num_samples(w));
+    lame_set_in_samplerate(enc->gf, sample_rate);
+    lame_set_num_channels(enc->gf, 1);
+    lame_set_mode(enc->gf, MONO);
+    if (lame_init_params(enc->gf) == -1) {
+        lame_close(enc->gf);
+        enc->gf = NULL;
+        return RBFLITE_ERROR_LAME_INIT_PARAMS;
+    }
+    return RBFLITE_ERROR_SUCCESS;
+}
+
+/* releases enc->gf. It is reused later if all data were flushed. */
+static void mp3_encoder_close(mp3_encoder_t *enc)
+{
+#ifdef HAVE_MP3_POOL
+    if (enc->flushed) {
+        mp3_pool_put(enc, enc->gf);
+        enc->gf = NULL;
+        return;
+    }
+#endif
+    lame_close(enc->gf);
+    enc->gf = NULL;
+}
+
+#ifdef HAVE_MP3_PIPELINE
+static int mp3_pipeline_readable(mp3_pipeline_t *pl)
+{
+    return ATOMIC_LOAD(&pl->tail) != pl->head || ATOMIC_LOAD(&pl->done);
+}
+
+static int mp3_pipeline_writable(mp3_pipeline_t *pl)
+{
+    return pl->tail - ATOMIC_LOAD(&pl->head) < MP3_RING_SIZE || ATOMIC_LOAD(&pl->error) || pl->owner->interrupted;
+}
+
+/*
+ * sleeps until ready() returns true. The waiting flag is set before
+ * ready() is checked and the other thread changes the state before it
+ * checks the flag in mp3_pipeline_wakeup(). So a wakeup is never lost.
+ */
+static void mp3_pipeline_sleep(mp3_pipeline_t *pl, int *waiting, int (*ready)(mp3_pipeline_t *))
+{
+    native_mutex_lock(&pl->mutex);
+    ATOMIC_STORE(waiting, 1);
+    while (!ready(pl)) {
+        native_cond_wait(&pl->cond, &pl->mutex);
+    }
+    ATOMIC_STORE(waiting, 0);
+    native_mutex_unlock(&pl->mutex);
+}
+
+/* wakes up the other thread if it sleeps. */
+static void mp3_pipeline_wakeup(mp3_pipeline_t *pl, int *waiting)
+{
+    if (ATOMIC_LOAD(waiting)) {
+        native_mutex_lock(&pl->mutex);
+        native_cond_signal(&pl->cond);
+        native_mutex_unlock(&pl->mutex);
+    }
+}
+
+/*
+ * called by voice_speech_ubf after owner->interrupted is set. This wakes
+ * up the flite thread waiting on the full ring to check interrupts.
+ */
+static void mp3_pipeline_unblock(void *arg)
+{
+    mp3_pipeline_t *pl = (mp3_pipeline_t *)arg;
+
+    native_mutex_lock(&pl->mutex);
+    native_cond_signal(&pl->cond);
+    native_mutex_unlock(&pl->mutex);
+}
+
+/*
+ * returns nonzero when the encoder thread must stop writing. This
+ * doesn't touch vsd because the thread isn't a ruby thread.
+ */
+static int mp3_pipeline_write_stop(void *arg)
+{
+    mp3_pipeline_t *pl = (mp3_pipeline_t *)arg;
+
+    if (ATOMIC_LOAD(&pl->error) != RBFLITE_ERROR_SUCCESS) {
+        return 1;
+    }
+    if (speech_interrupted(pl->vsd) || speech_interrupted(pl->owner)) {
+        ATOMIC_STORE(&pl->error, pl->owner->stopped ? RBFLITE_ERROR_INTERRUPTED : RBFLITE_ERROR_TIMEOUT);
+        return 1;
+    }
+    return 0;
+}
+
+/* This runs in the encoder thread. Errors are reported only through pl->error. */
+static int mp3_pipeline_output(mp3_pipeline_t *pl, const unsigned char *data, size_t size)
+{
+    /* check the limit here not to keep more data than :max_bytes in pl->out. */
+    if (pl->max_bytes != 0 && size > pl->max_bytes - pl->num_bytes) {
+        ATOMIC_STORE(&pl->error, RBFLITE_ERROR_MAX_BYTES);
+        return -1;
+    }
+    pl->num_bytes += size;
+    if (pl->vsd->fd != -1) {
+        int errnum = 0;
+
+        if (write_fd(pl->vsd->fd, data, size, &pl->written, &errnum, mp3_pipeline_write_stop, pl) != 0) {
+            if (errnum != 0) {
+                pl->errnum = errnum;
+                ATOMIC_STORE(&pl->error, RBFLITE_ERROR_WRITE);
+            }
+            return -1;
+        }
+        return 0;
+    }
+    if (pl->out_len + size > pl->out_capa) {
+        size_t capa = MAX(pl->out_capa * 2, MIN_SPEECH_DATA_SIZE);
+        unsigned char *out = realloc(pl->out, MAX(capa, pl->out_len + size));
+
+        if (out == NULL) {
+            ATOMIC_STORE(&pl->error, RBFLITE_ERROR_OUT_OF_MEMORY);
+            return -1;
+        }
+        pl->out = out;
+        pl->out_capa = MAX(capa, pl->out_len + size);
+    }
+    memcpy(pl->out + pl->out_len, data, size);
+    pl->out_len += size;
+    return 0;
+}
+
+/* the encoder thread */
+NATIVE_THREAD_FUNC(mp3_pipeline_encode, arg)
+{
+    mp3_pipeline_t *pl = (mp3_pipeline_t *)arg;
+    unsigned char mp3buf[MP3BUF_SIZE];
+    int rv;
+
+    for (;;) {
+        /* tail is final when done is set. */
+        int done = ATOMIC_LOAD(&pl->done);
+        size_t tail = ATOMIC_LOAD(&pl->tail);
+        size_t pos = pl->head & (MP3_RING_SIZE - 1);
+        size_t size;
+
+        if (tail == pl->head) {
+            if (done) {
+                break;
+            }
+            mp3_pipeline_sleep(pl, &pl->consumer_waiting, mp3_pipeline_readable);
+            continue;
+        }
+        size = MIN(tail - pl->head, MP3_RING_SIZE - pos);
+        size = MIN(size, MAX_SAMPLE_SIZE);
+        if (pl->error == RBFLITE_ERROR_SUCCESS) {
+            rv = lame_encode_buffer(pl->gf, pl->ring + pos, NULL, (int)size, mp3buf, sizeof(mp3buf));
+            if (rv < 0) {
+                ATOMIC_STORE(&pl->error, RBFLITE_ERROR_LAME_ENCODE_BUFFER);
+            } else if (rv > 0) {
+                mp3_pipeline_output(pl, mp3buf, rv);
+            }
+        }
+        ATOMIC_STORE(&pl->head, pl->head + size);
+        mp3_pipeline_wakeup(pl, &pl->producer_waiting);
+    }
+    if (pl->error == RBFLITE_ERROR_SUCCESS) {
+        rv = lame_encode_flush(pl->gf, mp3buf, sizeof(mp3buf));
+        if (rv < 0) {
+            ATOMIC_STORE(&pl->error, RBFLITE_ERROR_LAME_ENCODE_FLUSH);
+        } else if (rv > 0) {
+            mp3_pipeline_output(pl, mp3buf, rv);
+        }
+    }
+    NATIVE_THREAD_RETURN;
+}
+
+/* starts the encoder thread. This returns -1 when the data should be encoded in this thread. */
+static int mp3_pipeline_start(voice_speech_data_t *vsd, mp3_encoder_t *enc)
+{
+    mp3_pipeline_t *pl = enc->pl;
+
+    if (pl == NULL) {
+        pl = malloc(sizeof(mp3_pipeline_t));
+        if (pl == NULL) {
+            return -1;
+        }
+        native_mutex_init(&pl->mutex);
+        native_cond_init(&pl->cond);
+        pl->out = NULL;
+        pl->out_capa = 0;
+        enc->pl = pl;
+    }
+    pl->gf = enc->gf;
+    pl->vsd = vsd;
+    pl->owner = vsd->owner;
+    if (pl->owner->unblock == NULL) {
+        /* pl is kept until mp3_encoder_fini(), after synthesis finishes. */
+        pl->owner->unblock_arg = pl;
+        pl->owner->unblock = mp3_pipeline_unblock;
+    }
+    pl->head = 0;
+    pl->tail = 0;
+    pl->done = 0;
+    pl->producer_waiting = 0;
+    pl->consumer_waiting = 0;
+    pl->error = RBFLITE_ERROR_SUCCESS;
+    pl->errnum = 0;
+    pl->written = 0;
+    pl->max_bytes = vsd->max_bytes;
+    pl->num_bytes = vsd->num_bytes;
+    pl->out_len = 0;
+    if (native_thread_create(&pl->thread, mp3_pipeline_encode, pl) != 0) {
+        return -1;
+    }
+    enc->running = 1;
+    return 0;
+}
+
+/* pushes samples to the ring buffer. This waits while the ring is full. */
+static int mp3_pipeline_push(mp3_pipeline_t *pl, const short *samples, size_t size)
+{
+    while (size > 0) {
+        size_t used = pl->tail - ATOMIC_LOAD(&pl->head);
+        size_t pos = pl->tail & (MP3_RING_SIZE - 1);
+        size_t n;
+
+        if (ATOMIC_LOAD(&pl->error)) {
+            return -1;
+        }
+        if (used == MP3_RING_SIZE) {
+            mp3_pipeline_sleep(pl, &pl->producer_waiting, mp3_pipeline_writable);
+            if (check_interrupt(pl->owner) != 0) {
+                /* The encoder thread discards the rest. */
+                ATOMIC_STORE(&pl->error, pl->owner->error);
+                return -1;
+            }
+            continue;
+        }
+        n = MIN(size, MP3_RING_SIZE - used);
+        n = MIN(n, MP3_RING_SIZE - pos);
+        memcpy(pl->ring + pos, samples, n * sizeof(short));
+        ATOMIC_STORE(&pl->tail, pl->tail + n);
+        mp3_pipeline_wakeup(pl, &pl->consumer_waiting);
+        samples += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* waits for the encoder thread to encode all pushed samples. */
+static void mp3_pipeline_stop(mp3_encoder_t *enc)
+{
+    mp3_pipeline_t *pl = enc->pl;
+
+    ATOMIC_STORE(&pl->done, 1);
+    mp3_pipeline_wakeup(pl, &pl->consumer_waiting);
+    native_thread_join(pl->thread);
+    enc->running = 0;
+}
+
+/* stops the encoder thread and adds the encoded data to vsd. */
+static int mp3_pipeline_finish(voice_speech_data_t *vsd, mp3_encoder_t *enc)
+{
+    mp3_pipeline_t *pl = enc->pl;
+
+    mp3_pipeline_stop(enc);
+    /* The encoder thread has finished. Its results are moved to vsd. */
+    vsd->written += pl->written;
+    if (vsd->fd != -1) {
+        /* pl->out is added by add_data() below otherwise. */
+        vsd->num_bytes += pl->written;
+    }
+    if (pl->error != RBFLITE_ERROR_SUCCESS) {
+        if (vsd->error == RBFLITE_ERROR_SUCCESS) {
+            vsd->error = pl->error;
+            vsd->errnum = pl->errnum;
+        }
+        return -1;
+    }
+    enc->flushed = 1;
+    if (pl->out_len > 0) {
+        return add_data(vsd, pl->out, pl->out_len);
+    }
+    return 0;
+}
+#endif
+
+static int mp3_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    mp3_encoder_t *enc = vsd->encoder;
+    lame_global_flags *gf;
+    unsigned char mp3buf[MP3BUF_SIZE];
+    short *sptr = &w->samples[start];
+    short *eptr = sptr + size;
+    int rv;
+
+    if (start == 0) {
+        enum rbfile_error err;
+
+        if (enc->gf != NULL) {
+            /* The encoder was used by the previous text. */
+            mp3_encoder_close(enc);
+        }
+        err = mp3_encoder_open(enc, w);
+        if (err != RBFLITE_ERROR_SUCCESS) {
+            vsd->error = err;
+            return CST_AUDIO_STREAM_STOP;
+        }
+#ifdef HAVE_MP3_PIPELINE
+        if (enc->pipeline && !vsd->yield_chunks) {
+            /* The data are encoded in this thread when the encoder thread cannot start. */
+            mp3_pipeline_start(vsd, enc);
+        }
+#endif
+    }
+#ifdef HAVE_MP3_PIPELINE
+    if (enc->running) {
+        rv = mp3_pipeline_push(enc->pl, sptr, size);
+        if (rv != 0 || last) {
+            if (mp3_pipeline_finish(vsd, enc) != 0) {
+                return CST_AUDIO_STREAM_STOP;
+            }
+        }
+        return CST_AUDIO_STREAM_CONT;
+    }
+#endif
+    gf = enc->gf;
     while (eptr - sptr > MAX_SAMPLE_SIZE) {
         rv = lame_encode_buffer(gf, sptr, NULL, MAX_SAMPLE_SIZE, mp3buf, sizeof(mp3buf));
         if (rv < 0) {
-            vsd->error = RBFLITE_ERROR_LAME_ENCODE_BUFFER;
+            vsd->error = RBFLITE_ERROR_LAME_ENCODE_BUFFER;
+            return CST_AUDIO_STREAM_STOP;
+        }
+        if (rv > 0) {
+            if (add_data(vsd, mp3buf, rv) != 0) {
+                return CST_AUDIO_STREAM_STOP;
+            }
+        }
+        sptr += MAX_SAMPLE_SIZE;
+    }
+    rv = lame_encode_buffer(gf, sptr, NULL, eptr - sptr, mp3buf, sizeof(mp3buf));
+    if (rv < 0) {
+        vsd->error = RBFLITE_ERROR_LAME_ENCODE_BUFFER;
+        return CST_AUDIO_STREAM_STOP;
+    }
+    if (rv > 0) {
+        if (add_data(vsd, mp3buf, rv) != 0) {
+            return CST_AUDIO_STREAM_STOP;
+        }
+    }
+    if (last) {
+        rv = lame_encode_flush(gf, mp3buf, sizeof(mp3buf));
+        if (rv < 0) {
+            vsd->error = RBFLITE_ERROR_LAME_ENCODE_FLUSH;
+            return CST_AUDIO_STREAM_STOP;
+        }
+        enc->flushed = 1;
+        if (rv > 0) {
+            if (add_data(vsd, mp3buf, rv) != 0) {
+                return CST_AUDIO_STREAM_STOP;
+            }
+        }
+    }
+    return CST_AUDIO_STREAM_CONT;
+}
+
+static void *mp3_encoder_init(VALUE opts)
+{
+    mp3_encoder_t *enc;
+    int bitrate = 64;
+    int scale = 0;
+    int scale_set = 0;
+    int quality = -1;
+    int pipeline = 0;
+
+    if (!NIL_P(opts)) {
+        VALUE v;
+        Check_Type(opts, T_HASH);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("bitrate")));
+        if (!NIL_P(v)) {
+            bitrate = NUM2INT(v);
+        }
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("scale")));
+        if (!NIL_P(v)) {
+            scale = NUM2INT(v);
+            scale_set = 1;
+        }
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("quality")));
+        if (!NIL_P(v)) {
+            quality = NUM2INT(v);
+        }
+
+        pipeline = RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("pipeline"))));
+    }
+
+    enc = ALLOC(mp3_encoder_t);
+    enc->gf = NULL;
+    enc->sample_rate = 0;
+    enc->flushed = 0;
+    enc->bitrate = bitrate;
+    enc->scale = scale;
+    enc->scale_set = scale_set;
+    enc->quality = quality;
+    enc->pipeline = pipeline;
+#ifdef HAVE_MP3_PIPELINE
+    enc->running = 0;
+    enc->pl = NULL;
+#endif
+    return enc;
+}
+
+#ifdef HAVE_MP3_PIPELINE
+static void *mp3_pipeline_stop_without_gvl(void *arg)
+{
+    mp3_pipeline_stop((mp3_encoder_t *)arg);
+    return NULL;
+}
+
+static VALUE mp3_pipeline_abort_body(VALUE arg)
+{
+    /* This calls the function even when interrupts are pending. */
+    rb_thread_call_without_gvl(mp3_pipeline_stop_without_gvl, (void *)arg, NULL, NULL);
+    return Qnil;
+}
+
+/*
+ * stops the encoder thread when synthesis was stopped before the last
+ * samples. The thread is joined without the GVL because it may be
+ * writing to a pipe read by a ruby thread. An exception raised after
+ * that is kept in vsd->state as exceptions raised in callbacks.
+ */
+static void mp3_pipeline_abort(mp3_encoder_t *enc)
+{
+    mp3_pipeline_t *pl = enc->pl;
+    voice_speech_data_t *vsd = pl->vsd;
+    VALUE errinfo = rb_errinfo();
+    int state = 0;
+
+    /* The encoder thread discards the rest. */
+    ATOMIC_STORE(&pl->error, RBFLITE_ERROR_INTERRUPTED);
+    rb_protect(mp3_pipeline_abort_body, (VALUE)enc, &state);
+    if (state != 0) {
+        if (vsd->state == 0) {
+            vsd->state = state;
+        } else {
+            rb_set_errinfo(errinfo);
+        }
+    }
+}
+#endif
+
+static void mp3_encoder_fini(void *encoder)
+{
+    mp3_encoder_t *enc = encoder;
+
+#ifdef HAVE_MP3_PIPELINE
+    if (enc->pl != NULL) {
+        if (enc->running) {
+            mp3_pipeline_abort(enc);
+        }
+        if (enc->pl->owner->unblock_arg == enc->pl) {
+            enc->pl->owner->unblock = NULL;
+        }
+        native_mutex_destroy(&enc->pl->mutex);
+        native_cond_destroy(&enc->pl->cond);
+        free(enc->pl->out);
+        free(enc->pl);
+    }
+#endif
+    if (enc->gf != NULL) {
+        mp3_encoder_close(enc);
+    }
+    xfree(enc);
+}
+
+static audio_stream_encoder_t mp3_encoder = {
+    mp3_encoder_cb,
+    mp3_encoder_init,
+    mp3_encoder_fini,
+};
+
+#ifdef HAVE_MP3_POOL
+/*
+ *  Returns statistics of the pool of mp3 encoders.
+ *
+ *  A lame encoder is reset and kept in the pool after an mp3 speech
+ *  is encoded. It is reused by later speeches with the same sample
+ *  rate, bitrate, quality and scale without initializing lame again.
+ *
+ *  @example
+ *    Flite.mp3_encoder_pool_stats
+ *    # => {:size=>2, :max_size=>16, :hits=>98, :misses=>2}
+ *
+ *  @return [Hash] :size is the number of idle encoders. :hits and
+ *    :misses are the number of times an encoder was reused or created.
+ */
+static VALUE
+flite_s_mp3_encoder_pool_stats(VALUE klass)
+{
+    VALUE hash = rb_hash_new();
+    long size, max_size;
+    unsigned long hits, misses;
+
+    native_mutex_lock(&mp3_pool_mutex);
+    size = mp3_pool_size;
+    max_size = mp3_pool_max_size;
+    hits = mp3_pool_hits;
+    misses = mp3_pool_misses;
+    native_mutex_unlock(&mp3_pool_mutex);
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("size")), LONG2NUM(size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max_size")), LONG2NUM(max_size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")), ULONG2NUM(hits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")), ULONG2NUM(misses));
+    return hash;
+}
+
+/*
+ * @overload mp3_encoder_pool_max_size=(size)
+ *
+ *  Sets the maximum number of idle mp3 encoders in the pool.
+ *  The default value is 16. Zero disables the pool.
+ *
+ *  @param [Integer] size
+ *  @see Flite.mp3_encoder_pool_stats
+ */
+static VALUE
+flite_s_set_mp3_encoder_pool_max_size(VALUE klass, VALUE val)
+{
+    long max_size = NUM2LONG(val);
+    mp3_pool_entry_t *entries = NULL;
+
+    if (max_size < 0) {
+        rb_raise(rb_eArgError, "negative pool size");
+    }
+    native_mutex_lock(&mp3_pool_mutex);
+    mp3_pool_max_size = max_size;
+    while (mp3_pool_size > max_size) {
+        mp3_pool_entry_t *entry = mp3_pool;
+        mp3_pool = entry->next;
+        mp3_pool_size--;
+        entry->next = entries;
+        entries = entry;
+    }
+    native_mutex_unlock(&mp3_pool_mutex);
+
+    /* close encoders removed from the pool. */
+    while (entries != NULL) {
+        mp3_pool_entry_t *next = entries->next;
+        lame_close(entries->gf);
+        free(entries);
+        entries = next;
+    }
+    return val;
+}
+#endif
+
+#endif
+
+#ifdef HAVE_OPUS
+
+#define OPUS_MAX_FRAME_SIZE 2880 /* 60 ms at 48 kHz */
+#define OPUS_MAX_PACKET_SIZE 4000
+#define OPUS_SERIALNO 0x666c6974 /* fixed to make same audio data for same text */
+#define OGG_MAX_SEGMENTS 255
+#define OGG_PAGE_SIZE 4096 /* a page is written when its body exceeds this size */
+
+/* Ogg page writer. A packet never spans pages. */
+typedef struct {
+    unsigned int pageno;
+    int64_t granulepos; /* granule position of the last packet in the page */
+    int bos; /* nonzero until the first page is written */
+    int num_segments;
+    unsigned char segments[OGG_MAX_SEGMENTS];
+    size_t body_len;
+    unsigned char body[OGG_MAX_SEGMENTS * 255];
+} ogg_writer_t;
+
+typedef struct {
+    OpusEncoder *oe;
+    int bitrate; /* kbps */
+    int complexity; /* -1 when not set */
+    int frame_ms10; /* frame duration in 0.1 ms */
+    int sample_rate;
+    int frame_size; /* number of samples in a frame */
+    int scale48; /* 48000 / sample_rate */
+    int pre_skip; /* number of samples at 48 kHz skipped by decoders */
+    int64_t num_samples; /* number of input samples */
+    int64_t granulepos; /* number of samples at 48 kHz in encoded frames */
+    int frame_len; /* number of samples in frame */
+    short frame[OPUS_MAX_FRAME_SIZE];
+    unsigned char packet[OPUS_MAX_PACKET_SIZE];
+    ogg_writer_t ogg;
+} opus_encoder_t;
+
+static unsigned int ogg_crc_table[256];
+
+static void ogg_crc_init(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < 256; i++) {
+        unsigned int crc = i << 24;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04c11db7) : (crc << 1);
+        }
+        ogg_crc_table[i] = crc;
+    }
+}
+
+static unsigned int ogg_crc(unsigned int crc, const unsigned char *data, size_t size)
+{
+    while (size-- > 0) {
+        crc = (crc << 8) ^ ogg_crc_table[((crc >> 24) ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+static void put_le16(unsigned char *buf, unsigned int val)
+{
+    buf[0] = val & 0xff;
+    buf[1] = (val >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *buf, unsigned int val)
+{
+    put_le16(buf, val & 0xffff);
+    put_le16(buf + 2, val >> 16);
+}
+
+static void put_le64(unsigned char *buf, int64_t val)
+{
+    put_le32(buf, (unsigned int)((uint64_t)val & 0xffffffff));
+    put_le32(buf + 4, (unsigned int)((uint64_t)val >> 32));
+}
+
+static void ogg_writer_init(ogg_writer_t *ow)
+{
+    ow->pageno = 0;
+    ow->granulepos = 0;
+    ow->bos = 1;
+    ow->num_segments = 0;
+    ow->body_len = 0;
+}
+
+static int ogg_write_page(voice_speech_data_t *vsd, ogg_writer_t *ow, int eos)
+{
+    unsigned char header[27 + OGG_MAX_SEGMENTS];
+    size_t header_len = 27 + ow->num_segments;
+    unsigned int crc;
+
+    memcpy(header, "OggS", 4);
+    header[4] = 0; /* version */
+    header[5] = (ow->bos ? 0x02 : 0) | (eos ? 0x04 : 0);
+    put_le64(header + 6, ow->granulepos);
+    put_le32(header + 14, OPUS_SERIALNO);
+    put_le32(header + 18, ow->pageno);
+    put_le32(header + 22, 0); /* CRC */
+    header[26] = ow->num_segments;
+    memcpy(header + 27, ow->segments, ow->num_segments);
+    crc = ogg_crc(0, header, header_len);
+    crc = ogg_crc(crc, ow->body, ow->body_len);
+    put_le32(header + 22, crc);
+
+    if (add_data(vsd, header, header_len) != 0 || add_data(vsd, ow->body, ow->body_len) != 0) {
+        return -1;
+    }
+    ow->pageno++;
+    ow->bos = 0;
+    ow->num_segments = 0;
+    ow->body_len = 0;
+    return 0;
+}
+
+/* adds a packet. The page is written when flush or eos is nonzero. */
+static int ogg_write_packet(voice_speech_data_t *vsd, ogg_writer_t *ow, const unsigned char *data, size_t size, int64_t granulepos, int flush, int eos)
+{
+    int num_segments = (int)(size / 255) + 1;
+
+    if (ow->num_segments > 0 && (ow->num_segments + num_segments > OGG_MAX_SEGMENTS || ow->body_len + size > OGG_PAGE_SIZE)) {
+        if (ogg_write_page(vsd, ow, 0) != 0) {
+            return -1;
+        }
+    }
+    /* lacing values: 255 for each 255 bytes and the rest, which may be 0 */
+    memset(ow->segments + ow->num_segments, 255, num_segments - 1);
+    ow->segments[ow->num_segments + num_segments - 1] = size % 255;
+    ow->num_segments += num_segments;
+    memcpy(ow->body + ow->body_len, data, size);
+    ow->body_len += size;
+    ow->granulepos = granulepos;
+    if (flush || eos) {
+        return ogg_write_page(vsd, ow, eos);
+    }
+    return 0;
+}
+
+/* creates or resets the opus encoder and writes the Ogg Opus headers. */
+static int opus_encoder_start(voice_speech_data_t *vsd, opus_encoder_t *enc, const cst_wave *w)
+{
+    int sample_rate = cst_wave_sample_rate(w);
+    const char *vendor = opus_get_version_string();
+    size_t vendor_len = strlen(vendor);
+    unsigned char head[19];
+    opus_int32 lookahead;
+    int err;
+
+    if (sample_rate < 8000 || 48000 % sample_rate != 0) {
+        vsd->error = RBFLITE_ERROR_OPUS_SAMPLE_RATE;
+        vsd->errnum = sample_rate;
+        return -1;
+    }
+    if (enc->oe != NULL && enc->sample_rate == sample_rate) {
+        /* The encoder was used by the previous text. */
+        opus_encoder_ctl(enc->oe, OPUS_RESET_STATE);
+    } else {
+        if (enc->oe != NULL) {
+            opus_encoder_destroy(enc->oe);
+        }
+        enc->oe = opus_encoder_create(sample_rate, 1, OPUS_APPLICATION_VOIP, &err);
+        if (enc->oe == NULL) {
+            vsd->error = RBFLITE_ERROR_OPUS;
+            vsd->errnum = err;
+            return -1;
+        }
+        opus_encoder_ctl(enc->oe, OPUS_SET_BITRATE(enc->bitrate * 1000));
+        opus_encoder_ctl(enc->oe, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+        if (enc->complexity != -1) {
+            opus_encoder_ctl(enc->oe, OPUS_SET_COMPLEXITY(enc->complexity));
+        }
+        enc->sample_rate = sample_rate;
+    }
+    opus_encoder_ctl(enc->oe, OPUS_GET_LOOKAHEAD(&lookahead));
+    enc->frame_size = sample_rate * enc->frame_ms10 / 10000;
+    enc->scale48 = 48000 / sample_rate;
+    enc->pre_skip = lookahead * enc->scale48;
+    enc->num_samples = 0;
+    enc->granulepos = 0;
+    enc->frame_len = 0;
+    ogg_writer_init(&enc->ogg);
+
+    /* identification header */
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1; /* version */
+    head[9] = 1; /* channel count */
+    put_le16(head + 10, enc->pre_skip);
+    put_le32(head + 12, sample_rate);
+    put_le16(head + 16, 0); /* output gain */
+    head[18] = 0; /* channel mapping family */
+    if (ogg_write_packet(vsd, &enc->ogg, head, sizeof(head), 0, 1, 0) != 0) {
+        return -1;
+    }
+
+    /* comment header without user comments */
+    memcpy(enc->packet, "OpusTags", 8);
+    put_le32(enc->packet + 8, (unsigned int)vendor_len);
+    memcpy(enc->packet + 12, vendor, vendor_len);
+    put_le32(enc->packet + 12 + vendor_len, 0);
+    return ogg_write_packet(vsd, &enc->ogg, enc->packet, 16 + vendor_len, 0, 1, 0);
+}
+
+/* encodes enc->frame padded with zeros. */
+static int opus_encode_frame(voice_speech_data_t *vsd, opus_encoder_t *enc, int last)
+{
+    int64_t granulepos = enc->granulepos + enc->frame_size * enc->scale48;
+    int64_t end = enc->pre_skip + enc->num_samples * enc->scale48;
+    opus_int32 len;
+
+    memset(enc->frame + enc->frame_len, 0, (enc->frame_size - enc->frame_len) * sizeof(short));
+    enc->frame_len = 0;
+    len = opus_encode(enc->oe, enc->frame, enc->frame_size, enc->packet, sizeof(enc->packet));
+    if (len < 0) {
+        vsd->error = RBFLITE_ERROR_OPUS;
+        vsd->errnum = len;
+        return -1;
+    }
+    enc->granulepos = granulepos;
+    if (last) {
+        /* The granule position of the last page tells decoders the end of audio data. */
+        granulepos = end;
+    }
+    return ogg_write_packet(vsd, &enc->ogg, enc->packet, len, granulepos, 0, last);
+}
+
+static int opus_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    opus_encoder_t *enc = vsd->encoder;
+    const short *sptr = &w->samples[start];
+
+    if (start == 0) {
+        if (opus_encoder_start(vsd, enc, w) != 0) {
+            return CST_AUDIO_STREAM_STOP;
+        }
+    }
+    enc->num_samples += size;
+    while (size > 0) {
+        int n = MIN(size, enc->frame_size - enc->frame_len);
+
+        memcpy(enc->frame + enc->frame_len, sptr, n * sizeof(short));
+        enc->frame_len += n;
+        sptr += n;
+        size -= n;
+        if (enc->frame_len == enc->frame_size) {
+            if (opus_encode_frame(vsd, enc, 0) != 0) {
+                return CST_AUDIO_STREAM_STOP;
+            }
+        }
+    }
+    if (last) {
+        /* Encode frames until samples delayed by the encoder are flushed. */
+        int64_t end = enc->pre_skip + enc->num_samples * enc->scale48;
+        int eos;
+
+        do {
+            eos = (enc->granulepos + enc->frame_size * enc->scale48 >= end);
+            if (opus_encode_frame(vsd, enc, eos) != 0) {
+                return CST_AUDIO_STREAM_STOP;
+            }
+        } while (!eos);
+    }
+    return CST_AUDIO_STREAM_CONT;
+}
+
+static void *opus_encoder_init(VALUE opts)
+{
+    opus_encoder_t *enc;
+    int bitrate = 24;
+    int complexity = -1;
+    int frame_ms10 = 200;
+
+    if (!NIL_P(opts)) {
+        VALUE v;
+        Check_Type(opts, T_HASH);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("bitrate")));
+        if (!NIL_P(v)) {
+            bitrate = NUM2INT(v);
+        }
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("complexity")));
+        if (!NIL_P(v)) {
+            complexity = NUM2INT(v);
+            if (complexity < 0 || 10 < complexity) {
+                rb_raise(rb_eArgError, "opus complexity must be between 0 and 10");
+            }
+        }
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("frame_size")));
+        if (!NIL_P(v)) {
+            frame_ms10 = (int)(NUM2DBL(v) * 10 + 0.5);
+            switch (frame_ms10) {
+            case 25: case 50: case 100: case 200: case 400: case 600:
+                break;
+            default:
+                rb_raise(rb_eArgError, "opus frame size must be 2.5, 5, 10, 20, 40 or 60");
+            }
+        }
+    }
+
+    enc = ALLOC(opus_encoder_t);
+    enc->oe = NULL;
+    enc->bitrate = bitrate;
+    enc->complexity = complexity;
+    enc->frame_ms10 = frame_ms10;
+    enc->sample_rate = 0;
+    return enc;
+}
+
+static void opus_encoder_fini(void *encoder)
+{
+    opus_encoder_t *enc = encoder;
+
+    if (enc->oe != NULL) {
+        opus_encoder_destroy(enc->oe);
+    }
+    xfree(enc);
+}
+
+static audio_stream_encoder_t opus_encoder = {
+    opus_encoder_cb,
+    opus_encoder_init,
+    opus_encoder_fini,
+};
+
+#endif
+
+/*
+ * FLAC encoder using fixed predictors and partitioned Rice coding.
+ * See https://xiph.org/flac/format.html
+ */
+#define FLAC_MAX_BLOCK_SIZE 4096
+#define FLAC_MAX_FIXED_ORDER 4
+#define FLAC_MAX_RICE_PARAM 14 /* 15 is the escape code */
+/* A subframe is verbatim if Rice coding doesn't make it smaller. */
+#define FLAC_MAX_FRAME_SIZE (FLAC_MAX_BLOCK_SIZE * 2 + 32)
+
+typedef struct {
+    int blocksize;
+    int max_order; /* maximum order of fixed predictors */
+    int max_porder; /* maximum partition order of Rice coding */
+    int sample_rate;
+    unsigned int frame_number;
+    int block_len; /* number of samples in block */
+    int32_t block[FLAC_MAX_BLOCK_SIZE];
+    uint32_t residual[FLAC_MAX_BLOCK_SIZE]; /* zigzag-encoded residual of the chosen order */
+    unsigned char frame[FLAC_MAX_FRAME_SIZE];
+} flac_encoder_t;
+
+typedef struct {
+    unsigned char *buf;
+    size_t pos; /* number of bytes written to buf */
+    uint64_t acc;
+    int nbits; /* number of bits in acc not written to buf */
+} bit_writer_t;
+
+static unsigned char flac_crc8_table[256];
+static unsigned short flac_crc16_table[256];
+
+static void flac_crc_init(void)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < 256; i++) {
+        unsigned int crc8 = i;
+        unsigned int crc16 = i << 8;
+        for (j = 0; j < 8; j++) {
+            crc8 = (crc8 & 0x80) ? ((crc8 << 1) ^ 0x07) : (crc8 << 1);
+            crc16 = (crc16 & 0x8000) ? ((crc16 << 1) ^ 0x8005) : (crc16 << 1);
+        }
+        flac_crc8_table[i] = crc8 & 0xff;
+        flac_crc16_table[i] = crc16 & 0xffff;
+    }
+}
+
+static void bw_init(bit_writer_t *bw, unsigned char *buf)
+{
+    bw->buf = buf;
+    bw->pos = 0;
+    bw->acc = 0;
+    bw->nbits = 0;
+}
+
+/* writes the lower nbits bits of val. nbits must be 32 or less. */
+static void bw_put(bit_writer_t *bw, uint32_t val, int nbits)
+{
+    bw->acc = (bw->acc << nbits) | (val & ((UINT64_C(1) << nbits) - 1));
+    bw->nbits += nbits;
+    while (bw->nbits >= 8) {
+        bw->nbits -= 8;
+        bw->buf[bw->pos++] = (unsigned char)(bw->acc >> bw->nbits);
+    }
+}
+
+static void bw_put_rice(bit_writer_t *bw, uint32_t val, int k)
+{
+    uint32_t q = val >> k;
+
+    /* unary coded quotient */
+    while (q >= 32) {
+        bw_put(bw, 0, 32);
+        q -= 32;
+    }
+    bw_put(bw, 1, q + 1);
+    if (k > 0) {
+        bw_put(bw, val, k);
+    }
+}
+
+/* pads zero bits to the byte boundary. */
+static void bw_align(bit_writer_t *bw)
+{
+    if (bw->nbits > 0) {
+        bw_put(bw, 0, 8 - bw->nbits);
+    }
+}
+
+static int flac_sample_rate_code(int sample_rate)
+{
+    switch (sample_rate) {
+    case 88200: return 1;
+    case 176400: return 2;
+    case 192000: return 3;
+    case 8000: return 4;
+    case 16000: return 5;
+    case 22050: return 6;
+    case 24000: return 7;
+    case 32000: return 8;
+    case 44100: return 9;
+    case 48000: return 10;
+    case 96000: return 11;
+    }
+    if (sample_rate % 1000 == 0 && sample_rate / 1000 < 256) {
+        return 12; /* 8-bit sample rate in kHz at the end of the header */
+    }
+    if (sample_rate < 65536) {
+        return 13; /* 16-bit sample rate in Hz */
+    }
+    if (sample_rate % 10 == 0 && sample_rate / 10 < 65536) {
+        return 14; /* 16-bit sample rate in tens of Hz */
+    }
+    return 0; /* get from STREAMINFO */
+}
+
+/* computes zigzag-encoded residual of the fixed predictor of order. */
+static void flac_fixed_residual(const int32_t *x, int n, int order, uint32_t *res)
+{
+    int i;
+
+    for (i = order; i < n; i++) {
+        int32_t r;
+
+        switch (order) {
+        case 0: r = x[i]; break;
+        case 1: r = x[i] - x[i - 1]; break;
+        case 2: r = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+        case 3: r = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+        default: r = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+        }
+        res[i] = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+    }
+}
+
+/* chooses the order whose sum of absolute residual is the smallest. */
+static int flac_choose_order(const int32_t *x, int n, int max_order)
+{
+    uint64_t sum[FLAC_MAX_FIXED_ORDER + 1] = {0, };
+    int order, best = 0;
+    int i;
+
+    max_order = MIN(max_order, n - 1);
+    for (i = max_order; i < n; i++) {
+        int32_t e0 = x[i];
+        int32_t e1 = e0 - x[i - 1 < 0 ? 0 : i - 1];
+        int32_t e2 = (i >= 2) ? e1 - (x[i - 1] - x[i - 2]) : 0;
+        int32_t e3 = (i >= 3) ? e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]) : 0;
+        int32_t e4 = (i >= 4) ? e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]) : 0;
+
+        sum[0] += (e0 < 0) ? -e0 : e0;
+        sum[1] += (e1 < 0) ? -e1 : e1;
+        sum[2] += (e2 < 0) ? -e2 : e2;
+        sum[3] += (e3 < 0) ? -e3 : e3;
+        sum[4] += (e4 < 0) ? -e4 : e4;
+    }
+    for (order = 1; order <= max_order; order++) {
+        if (sum[order] < sum[best]) {
+            best = order;
+        }
+    }
+    return best;
+}
+
+/* returns the number of bits of res[start..end) coded with the best Rice parameter. */
+static uint64_t flac_rice_bits(const uint32_t *res, int start, int end, int *param)
+{
+    uint64_t sum = 0;
+    uint64_t best_bits = UINT64_MAX;
+    int n = end - start;
+    int k0 = 0;
+    int k, i;
+
+    for (i = start; i < end; i++) {
+        sum += res[i];
+    }
+    if (n > 0) {
+        while (k0 < FLAC_MAX_RICE_PARAM && ((uint64_t)n << (k0 + 1)) <= sum) {
+            k0++;
+        }
+    }
+    *param = k0;
+    for (k = MAX(k0 - 1, 0); k <= MIN(k0 + 1, FLAC_MAX_RICE_PARAM); k++) {
+        uint64_t bits = (uint64_t)n * (k + 1);
+
+        for (i = start; i < end; i++) {
+            bits += res[i] >> k;
+        }
+        if (bits < best_bits) {
+            best_bits = bits;
+            *param = k;
+        }
+    }
+    return best_bits;
+}
+
+/* encodes a block of n samples as a frame to enc->frame and returns its size. */
+static size_t flac_encode_frame(flac_encoder_t *enc, int n)
+{
+    const int32_t *x = enc->block;
+    int rate_code = flac_sample_rate_code(enc->sample_rate);
+    unsigned int fn = enc->frame_number++;
+    int params[1 << 8];
+    int order, porder, best_porder = -1;
+    uint64_t best_bits = (uint64_t)n * 16;
+    bit_writer_t bw;
+    unsigned int crc;
+    size_t i;
+    int j;
+
+    bw_init(&bw, enc->frame);
+
+    /* frame header */
+    bw_put(&bw, 0x3ffe, 14); /* sync code */
+    bw_put(&bw, 0, 1);
+    bw_put(&bw, 0, 1); /* fixed-blocksize stream */
+    bw_put(&bw, 7, 4); /* 16-bit (blocksize - 1) at the end of the header */
+    bw_put(&bw, rate_code, 4);
+    bw_put(&bw, 0, 4); /* mono */
+    bw_put(&bw, 4, 3); /* 16 bits per sample */
+    bw_put(&bw, 0, 1);
+    /* frame number coded like UTF-8 */
+    if (fn < 0x80) {
+        bw_put(&bw, fn, 8);
+    } else {
+        int len = (fn < 0x800) ? 2 : (fn < 0x10000) ? 3 : (fn < 0x200000) ? 4 : (fn < 0x4000000) ? 5 : 6;
+
+        bw_put(&bw, ((1u << len) - 1) << 1, len + 1);
+        bw_put(&bw, fn >> (6 * (len - 1)), 7 - len);
+        for (j = len - 2; j >= 0; j--) {
+            bw_put(&bw, 0x80 | ((fn >> (6 * j)) & 0x3f), 8);
+        }
+    }
+    bw_put(&bw, n - 1, 16);
+    switch (rate_code) {
+    case 12: bw_put(&bw, enc->sample_rate / 1000, 8); break;
+    case 13: bw_put(&bw, enc->sample_rate, 16); break;
+    case 14: bw_put(&bw, enc->sample_rate / 10, 16); break;
+    }
+    crc = 0;
+    for (i = 0; i < bw.pos; i++) {
+        crc = flac_crc8_table[crc ^ enc->frame[i]];
+    }
+    bw_put(&bw, crc, 8);
+
+    /* subframe */
+    for (j = 1; j < n && x[j] == x[0]; j++) {
+    }
+    if (j == n) {
+        bw_put(&bw, 0x00, 8); /* constant */
+        bw_put(&bw, x[0], 16);
+    } else {
+        order = flac_choose_order(x, n, enc->max_order);
+        flac_fixed_residual(x, n, order, enc->residual);
+        for (porder = 0; porder <= enc->max_porder; porder++) {
+            int num_parts = 1 << porder;
+            int part_len = n >> porder;
+            uint64_t bits = order * 16 + 6;
+            int p;
+
+            if ((n & (num_parts - 1)) != 0 || part_len <= order) {
+                break;
+            }
+            for (p = 0; p < num_parts && bits < best_bits; p++) {
+                int param;
+                bits += 4 + flac_rice_bits(enc->residual, (p == 0) ? order : p * part_len, (p + 1) * part_len, &param);
+            }
+            if (bits < best_bits) {
+                best_bits = bits;
+                best_porder = porder;
+            }
+        }
+        if (best_porder == -1) {
+            bw_put(&bw, 0x02, 8); /* verbatim */
+            for (j = 0; j < n; j++) {
+                bw_put(&bw, x[j], 16);
+            }
+        } else {
+            int num_parts = 1 << best_porder;
+            int part_len = n >> best_porder;
+            int p;
+
+            bw_put(&bw, (0x08 | order) << 1, 8); /* fixed */
+            for (j = 0; j < order; j++) {
+                bw_put(&bw, x[j], 16);
+            }
+            bw_put(&bw, 0, 2); /* Rice coding with 4-bit parameters */
+            bw_put(&bw, best_porder, 4);
+            for (p = 0; p < num_parts; p++) {
+                int start = (p == 0) ? order : p * part_len;
+                int end = (p + 1) * part_len;
+
+                flac_rice_bits(enc->residual, start, end, &params[p]);
+                bw_put(&bw, params[p], 4);
+                for (j = start; j < end; j++) {
+                    bw_put_rice(&bw, enc->residual[j], params[p]);
+                }
+            }
+        }
+    }
+
+    /* frame footer */
+    bw_align(&bw);
+    crc = 0;
+    for (i = 0; i < bw.pos; i++) {
+        crc = ((crc << 8) ^ flac_crc16_table[(crc >> 8) ^ enc->frame[i]]) & 0xffff;
+    }
+    bw_put(&bw, crc, 16);
+    return bw.pos;
+}
+
+/* writes the stream marker and the STREAMINFO block. */
+static int flac_write_header(voice_speech_data_t *vsd, flac_encoder_t *enc, const cst_wave *w)
+{
+    uint64_t total = cst_wave_num_samples(w);
+    bit_writer_t bw;
+
+    bw_init(&bw, enc->frame);
+    bw_put(&bw, 0x664c6143, 32); /* "fLaC" */
+    bw_put(&bw, 1, 1); /* last metadata block */
+    bw_put(&bw, 0, 7); /* STREAMINFO */
+    bw_put(&bw, 34, 24);
+    bw_put(&bw, enc->blocksize, 16); /* minimum block size */
+    bw_put(&bw, enc->blocksize, 16); /* maximum block size */
+    bw_put(&bw, 0, 24); /* minimum frame size: unknown */
+    bw_put(&bw, 0, 24); /* maximum frame size: unknown */
+    bw_put(&bw, enc->sample_rate, 20);
+    bw_put(&bw, cst_wave_num_channels(w) - 1, 3);
+    bw_put(&bw, 16 - 1, 5);
+    bw_put(&bw, (uint32_t)(total >> 32), 4);
+    bw_put(&bw, (uint32_t)total, 32);
+    /* MD5 signature: unknown */
+    memset(enc->frame + bw.pos, 0, 16);
+    return add_data(vsd, enc->frame, bw.pos + 16);
+}
+
+static int
+flac_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    flac_encoder_t *enc = vsd->encoder;
+    const short *sptr = &w->samples[start];
+
+    if (start == 0) {
+        enc->sample_rate = cst_wave_sample_rate(w);
+        enc->frame_number = 0;
+        enc->block_len = 0;
+        if (flac_write_header(vsd, enc, w) != 0) {
             return CST_AUDIO_STREAM_STOP;
         }
-        if (rv > 0) {
-            if (add_data(vsd, mp3buf, rv) != 0) {
+    }
+    while (size > 0) {
+        int n = MIN(size, enc->blocksize - enc->block_len);
+        int i;
+
+        for (i = 0; i < n; i++) {
+            enc->block[enc->block_len++] = sptr[i];
+        }
+        sptr += n;
+        size -= n;
+        if (enc->block_len == enc->blocksize) {
+            if (add_data(vsd, enc->frame, flac_encode_frame(enc, enc->block_len)) != 0) {
                 return CST_AUDIO_STREAM_STOP;
             }
+            enc->block_len = 0;
         }
-        sptr += MAX_SAMPLE_SIZE;
     }
-    rv = lame_encode_buffer(gf, sptr, NULL, eptr - sptr, mp3buf, sizeof(mp3buf));
-    if (rv < 0) {
-        vsd->error = RBFLITE_ERROR_LAME_ENCODE_BUFFER;
-        return CST_AUDIO_STREAM_STOP;
+    if (last && enc->block_len > 0) {
+        /* The last block may be shorter than others. */
+        if (add_data(vsd, enc->frame, flac_encode_frame(enc, enc->block_len)) != 0) {
+            return CST_AUDIO_STREAM_STOP;
+        }
+        enc->block_len = 0;
     }
-    if (rv > 0) {
-        if (add_data(vsd, mp3buf, rv) != 0) {
+    return CST_AUDIO_STREAM_CONT;
+}
+
+static void *flac_encoder_init(VALUE opts)
+{
+    flac_encoder_t *enc;
+    int level = 5;
+
+    if (!NIL_P(opts)) {
+        VALUE v;
+        Check_Type(opts, T_HASH);
+
+        v = rb_hash_aref(opts, ID2SYM(rb_intern("compression_level")));
+        if (!NIL_P(v)) {
+            level = NUM2INT(v);
+            if (level < 0 || 8 < level) {
+                rb_raise(rb_eArgError, "flac compression level must be between 0 and 8");
+            }
+        }
+    }
+
+    enc = ALLOC(flac_encoder_t);
+    enc->blocksize = (level <= 2) ? 1152 : FLAC_MAX_BLOCK_SIZE;
+    enc->max_order = (level == 0) ? 2 : FLAC_MAX_FIXED_ORDER;
+    enc->max_porder = (level <= 2) ? 3 : (level <= 5) ? 5 : 8;
+    return enc;
+}
+
+static void flac_encoder_fini(void *encoder)
+{
+    xfree(encoder);
+}
+
+static audio_stream_encoder_t flac_encoder = {
+    flac_encoder_cb,
+    flac_encoder_init,
+    flac_encoder_fini,
+};
+
+static VALUE
+yield_speech_data_body(VALUE arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)arg;
+    VALUE chunk = speech_data_finish(vsd);
+
+    if (!NIL_P(vsd->chunk_queue)) {
+        /* pass the chunk to the fiber waiting in speech_call_in_worker. */
+        rb_funcall(vsd->chunk_queue, rb_intern("push"), 1, chunk);
+    } else {
+        rb_yield(chunk);
+    }
+    return Qnil;
+}
+
+static void *
+yield_speech_data(void *data)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)data;
+
+    rb_protect(yield_speech_data_body, (VALUE)vsd, &vsd->state);
+    return NULL;
+}
+
+/*
+ * Audio stream callback used when a block is passed to to_speech.
+ * It calls the encoder callback and passes the encoded data to the
+ * block with the GVL while flite continues synthesis. The buffered
+ * data is limited to one chunk. The synthesis waits until the block
+ * returns.
+ */
+static int
+yield_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_data_t *vsd = (voice_speech_data_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    int rv = vsd->asc(w, start, size, last, last_arg);
+
+    if (rv == CST_AUDIO_STREAM_CONT && vsd->used > 0) {
+        rb_thread_call_with_gvl(yield_speech_data, vsd);
+        if (vsd->state != 0) {
             return CST_AUDIO_STREAM_STOP;
         }
     }
-    if (last) {
-        rv = lame_encode_flush(gf, mp3buf, sizeof(mp3buf));
-        if (rv < 0) {
-            vsd->error = RBFLITE_ERROR_LAME_ENCODE_FLUSH;
+    return rv;
+}
+
+static audio_stream_encoder_t *
+audio_type_to_encoder(VALUE audio_type)
+{
+    if (NIL_P(audio_type) || rb_equal(audio_type, sym_wav)) {
+        return &wav_encoder;
+    } else if (rb_equal(audio_type, sym_raw)) {
+        return &raw_encoder;
+    } else if (rb_equal(audio_type, sym_flac)) {
+        return &flac_encoder;
+    } else if (rb_equal(audio_type, sym_ulaw)) {
+        return &ulaw_encoder;
+    } else if (rb_equal(audio_type, sym_alaw)) {
+        return &alaw_encoder;
+#ifdef HAVE_MP3LAME
+    } else if (rb_equal(audio_type, sym_mp3)) {
+        return &mp3_encoder;
+#endif
+#ifdef HAVE_OPUS
+    } else if (rb_equal(audio_type, sym_opus)) {
+        return &opus_encoder;
+#endif
+    }
+    rb_raise(rb_eArgError, "unknown audio type");
+}
+
+/*
+ * Audio stream callback used by to_speech_multi. It passes each chunk
+ * to the encoder callbacks of all output formats.
+ */
+static int
+multi_encoder_cb(const cst_wave *w, int start, int size, int last, asc_last_arg_t last_arg)
+{
+    voice_speech_multi_t *vsm = (voice_speech_multi_t *)ASC_LAST_ARG_TO_USERDATA(last_arg);
+    long i;
+
+    for (i = 0; i < vsm->num_targets; i++) {
+        speech_target_t *target = &vsm->targets[i];
+        cst_audio_stream_callback asc = (target->vsd.resampler != NULL) ? resampler_cb : target->encoder->asc;
+        size_t num_bytes = target->vsd.num_bytes;
+        int rv;
+#ifdef HAVE_CST_AUDIO_STREAMING_INFO_UTT
+        target->asi = *last_arg;
+        target->asi.userdata = &target->vsd;
+        rv = asc(w, start, size, last, &target->asi);
+#else
+        rv = asc(w, start, size, last, &target->vsd);
+#endif
+        /* the output size of to_speech_multi is the total of all formats. */
+        vsm->vsd.num_bytes += target->vsd.num_bytes - num_bytes;
+        if (rv != CST_AUDIO_STREAM_CONT) {
             return CST_AUDIO_STREAM_STOP;
         }
-        if (rv > 0) {
-            if (add_data(vsd, mp3buf, rv) != 0) {
-                return CST_AUDIO_STREAM_STOP;
+    }
+    return CST_AUDIO_STREAM_CONT;
+}
+
+static void speech_multi_fini_encoders(voice_speech_multi_t *vsm);
+
+/* finalizes encoders of targets. vsd->encoder of voice_speech_multi_t is itself. */
+static void
+multi_encoder_fini(void *encoder)
+{
+    speech_multi_fini_encoders((voice_speech_multi_t *)encoder);
+}
+
+static audio_stream_encoder_t multi_encoder = {
+    multi_encoder_cb,
+    NULL,
+    multi_encoder_fini,
+};
+
+static VALUE
+speech_multi_init_encoders(VALUE arg)
+{
+    voice_speech_multi_t *vsm = (voice_speech_multi_t *)arg;
+
+    while (vsm->num_initialized < vsm->num_targets) {
+        speech_target_t *target = &vsm->targets[vsm->num_initialized];
+        int sample_rate = sample_rate_option(target->opts);
+
+        if (target->encoder->encoder_init) {
+            target->vsd.encoder = target->encoder->encoder_init(target->opts);
+        }
+        vsm->num_initialized++;
+        if (sample_rate != 0) {
+            target->vsd.resampler = resampler_new(sample_rate, target->encoder->asc);
+            if (target->vsd.resampler == NULL) {
+                rb_raise(rb_eNoMemError, "failed to allocate resampler");
+            }
+        }
+    }
+    return Qnil;
+}
+
+static void
+speech_multi_fini_encoders(voice_speech_multi_t *vsm)
+{
+    long i;
+
+    for (i = 0; i < vsm->num_initialized; i++) {
+        speech_target_t *target = &vsm->targets[i];
+
+        if (target->encoder->encoder_fini) {
+            target->encoder->encoder_fini(target->vsd.encoder);
+        }
+        resampler_free(target->vsd.resampler);
+        target->vsd.resampler = NULL;
+    }
+    vsm->num_initialized = 0;
+}
+
+/* function called without the GVL and whether it was called */
+typedef struct {
+    void *(*func)(void *);
+    void *arg;
+    voice_speech_data_t *vsd;
+    int interruptible; /* nonzero when voice_speech_ubf stops func */
+    int called;
+    VALUE error; /* exception raised with the GVL in a worker thread */
+} speech_call_t;
+
+static void *
+speech_call(void *data)
+{
+    speech_call_t *call = (speech_call_t *)data;
+    double cpu_time = thread_cpu_time();
+    void *rv;
+
+    call->called = 1;
+    rv = call->func(call->arg);
+    call->vsd->stats.cpu_time += thread_cpu_time() - cpu_time;
+    return rv;
+}
+
+static void
+speech_call_without_gvl(speech_call_t *call)
+{
+    /* This doesn't raise pending interrupts. */
+    rb_thread_call_without_gvl2(speech_call, call, call->interruptible ? voice_speech_ubf : NULL, call->vsd);
+}
+
+#ifdef HAVE_FIBER_SCHEDULER
+static VALUE
+speech_worker_body(VALUE arg)
+{
+    speech_call_t *call = (speech_call_t *)arg;
+    voice_speech_data_t *vsd = call->vsd;
+
+    speech_call_without_gvl(call);
+    if (vsd->state != 0) {
+        /* The exception is raised again by the fiber. */
+        call->error = rb_errinfo();
+        rb_set_errinfo(Qnil);
+        vsd->state = 0;
+    }
+    return Qnil;
+}
+
+static VALUE
+speech_worker_ensure(VALUE arg)
+{
+    speech_call_t *call = (speech_call_t *)arg;
+
+    if (!NIL_P(call->vsd->chunk_queue)) {
+        rb_funcall(call->vsd->chunk_queue, rb_intern("close"), 0);
+    }
+    return Qnil;
+}
+
+static VALUE
+speech_worker(void *arg)
+{
+    return rb_ensure(speech_worker_body, (VALUE)arg, speech_worker_ensure, (VALUE)arg);
+}
+
+static VALUE
+speech_worker_join(VALUE thread)
+{
+    return rb_funcall(thread, rb_intern("join"), 0);
+}
+
+static VALUE
+speech_worker_pop(VALUE queue)
+{
+    return rb_funcall(queue, rb_intern("pop"), 0);
+}
+
+static VALUE
+speech_worker_yield(VALUE chunk)
+{
+    return rb_yield(chunk);
+}
+
+static VALUE
+speech_worker_raise(VALUE exc)
+{
+    rb_exc_raise(exc);
+    return Qnil;
+}
+
+/*
+ * Calls call->func in a worker thread and waits for it through the
+ * fiber scheduler, so other fibers in this thread run meanwhile.
+ * Chunks for the block are passed from the worker through a sized
+ * queue and the block is called by this fiber. An exception raised
+ * here is stored in vsd->state after the worker finishes.
+ */
+static void
+speech_call_in_worker(speech_call_t *call)
+{
+    voice_speech_data_t *vsd = call->vsd;
+    VALUE thread;
+    int stopped = 0;
+    int state = 0;
+
+    call->error = Qnil;
+    if (rb_block_given_p()) {
+        VALUE size = INT2FIX(1);
+        vsd->chunk_queue = rb_class_new_instance(1, &size, rb_cSizedQueue);
+    }
+    thread = rb_thread_create(speech_worker, call);
+    if (!NIL_P(vsd->chunk_queue)) {
+        while (state == 0) {
+            /* nil when the queue is closed by the worker. */
+            VALUE chunk = rb_protect(speech_worker_pop, vsd->chunk_queue, &state);
+
+            if (state != 0 || NIL_P(chunk)) {
+                break;
+            }
+            rb_protect(speech_worker_yield, chunk, &state);
+        }
+    }
+    for (;;) {
+        int join_state = 0;
+
+        if (state != 0 && !stopped) {
+            /* stop synthesis and wait for the worker. */
+            vsd->stopped = 1;
+            if (!NIL_P(vsd->chunk_queue)) {
+                rb_funcall(vsd->chunk_queue, rb_intern("close"), 0);
             }
+            stopped = 1;
+        }
+        rb_protect(speech_worker_join, thread, &join_state);
+        if (join_state == 0) {
+            break;
+        }
+        /* The latest state matches rb_errinfo() of this fiber. */
+        state = join_state;
+    }
+    if (state == 0 && !NIL_P(call->error)) {
+        rb_protect(speech_worker_raise, call->error, &state);
+    }
+    if (state != 0) {
+        vsd->state = state;
+    }
+    vsd->chunk_queue = Qnil;
+    RB_GC_GUARD(thread);
+}
+#endif
+
+/*
+ * Calls call->func without the GVL. When the current fiber is
+ * non-blocking, it is called by a worker thread instead.
+ * When func isn't called because interrupts are pending, they are
+ * run and func is called again unless an exception is raised.
+ */
+static void
+speech_call_run(speech_call_t *call, voice_speech_data_t *vsd, int interruptible)
+{
+    call->vsd = vsd;
+    call->interruptible = interruptible;
+    call->called = 0;
+    for (;;) {
+#ifdef HAVE_FIBER_SCHEDULER
+        if (!NIL_P(rb_fiber_scheduler_current())) {
+            speech_call_in_worker(call);
+        } else
+#endif
+        speech_call_without_gvl(call);
+        if (call->called || vsd->state != 0) {
+            return;
         }
+        rb_protect(speech_check_ints_body, Qnil, &vsd->state);
     }
-    return CST_AUDIO_STREAM_CONT;
 }
 
-static void *mp3_encoder_init(VALUE opts)
+/* returns the Hash passed as the :stats option or nil. */
+static VALUE
+speech_stats_option(VALUE opts)
 {
-    lame_global_flags *gf = lame_init();
+    VALUE stats;
 
-    if (gf == NULL) {
-        rb_raise(rb_eFliteRuntimeError, "Failed to initialize lame");
+    if (!RB_TYPE_P(opts, T_HASH)) {
+        return Qnil;
+    }
+    stats = rb_hash_aref(opts, ID2SYM(rb_intern("stats")));
+    if (!NIL_P(stats)) {
+        if (!RB_TYPE_P(stats, T_HASH)) {
+            rb_raise(rb_eTypeError, "stats must be a Hash");
+        }
+        rb_check_frozen(stats);
     }
+    return stats;
+}
 
-    lame_set_bWriteVbrTag(gf, 0);
-    lame_set_brate(gf, 64);
+static void
+speech_stats_set(VALUE hash, const speech_stats_t *stats)
+{
+    rb_hash_aset(hash, ID2SYM(rb_intern("queue_wait")), DBL2NUM(stats->queue_wait));
+    rb_hash_aset(hash, ID2SYM(rb_intern("synthesis_time")), DBL2NUM(stats->synthesis_time));
+    rb_hash_aset(hash, ID2SYM(rb_intern("cpu_time")), DBL2NUM(stats->cpu_time));
+    rb_hash_aset(hash, ID2SYM(rb_intern("encode_time")), DBL2NUM(stats->encode_time));
+    rb_hash_aset(hash, ID2SYM(rb_intern("duration")), DBL2NUM(stats->duration));
+    rb_hash_aset(hash, ID2SYM(rb_intern("real_time_factor")),
+                 (stats->duration > 0) ? DBL2NUM(stats->synthesis_time / stats->duration) : Qnil);
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), SIZET2NUM(stats->bytes));
+}
 
-    if (!NIL_P(opts)) {
-        VALUE v;
-        Check_Type(opts, T_HASH);
+/* adds statistics of a call to the voice and sets them to the :stats option. */
+static void
+speech_stats_report(VALUE self, voice_speech_data_t *vsd, VALUE stats)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
 
-        v = rb_hash_aref(opts, ID2SYM(rb_intern("bitrate")));
-        if (!NIL_P(v)) {
-            lame_set_brate(gf, NUM2INT(v));
-        }
+    vsd->stats.bytes = vsd->num_bytes;
+    SHARED_LOCK(stats_mutex);
+    voice->num_calls++;
+    if (vsd->error != RBFLITE_ERROR_SUCCESS || vsd->state != 0) {
+        voice->num_errors++;
+    }
+    voice->stats.queue_wait += vsd->stats.queue_wait;
+    voice->stats.synthesis_time += vsd->stats.synthesis_time;
+    voice->stats.cpu_time += vsd->stats.cpu_time;
+    voice->stats.encode_time += vsd->stats.encode_time;
+    voice->stats.duration += vsd->stats.duration;
+    voice->stats.bytes += vsd->stats.bytes;
+    SHARED_UNLOCK(stats_mutex);
+    if (!NIL_P(stats)) {
+        speech_stats_set(stats, &vsd->stats);
+    }
+}
 
-        v = rb_hash_aref(opts, ID2SYM(rb_intern("scale")));
-        if (!NIL_P(v)) {
-            lame_set_scale(gf, NUM2INT(v));
-        }
+/*
+ * Returns voice data used by the current call.
+ * A frozen voice may be used by Ractors at the same time. Each call
+ * on it uses its own voice instance linked to the read-only data.
+ * Calls on other voices are serialized by the voice queue.
+ */
+static cst_voice *
+voice_acquire(VALUE self, thread_queue_entry_t *entry)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
 
-        v = rb_hash_aref(opts, ID2SYM(rb_intern("quality")));
-        if (!NIL_P(v)) {
-            lame_set_quality(gf, NUM2INT(v));
-        }
+    PROBE1(queue_enter, voice);
+#ifdef HAVE_FEAT_LINK_INTO
+    if (OBJ_FROZEN(self) && voice->cache_entry != NULL) {
+        PROBE1(queue_acquire, voice);
+        return voice_instance_new(voice->cache_entry->voice);
     }
+#endif
+    lock_thread(&voice->queue, entry);
+    PROBE1(queue_acquire, voice);
+    return voice->voice;
+}
 
-    lame_set_bWriteVbrTag(gf, 0);
-    return gf;
+typedef struct {
+    VALUE self;
+    thread_queue_entry_t *entry;
+    cst_voice *voice;
+} voice_acquire_arg_t;
+
+static VALUE
+voice_acquire_body(VALUE arg)
+{
+    voice_acquire_arg_t *vaa = (voice_acquire_arg_t *)arg;
+
+    vaa->voice = voice_acquire(vaa->self, vaa->entry);
+    return Qnil;
 }
 
-static void mp3_encoder_fini(void *encoder)
+static void
+voice_release(VALUE self, cst_voice *v)
 {
-    lame_close(encoder);
+    rbflite_voice_t *voice = DATA_PTR(self);
+
+    PROBE1(queue_release, voice);
+    if (v != voice->voice) {
+        delete_voice(v);
+    } else {
+        unlock_thread(&voice->queue);
+    }
 }
 
-static audio_stream_encoder_t mp3_encoder = {
-    mp3_encoder_cb,
-    mp3_encoder_init,
-    mp3_encoder_fini,
-};
+/*
+ * Calls <code>func</code> without the GVL while audio data synthesized
+ * by the voice are passed to <code>asc</code>. <code>func</code> calls
+ * flite_text_to_speech() for vsd->text or texts of voice_speech_batch_t.
+ *
+ * Interrupts such as Thread#raise stop synthesis through
+ * voice_speech_ubf. They are checked after cleanup.
+ */
+static void
+voice_stream_speech(VALUE self, voice_speech_data_t *vsd, audio_stream_encoder_t *encoder, VALUE opts, cst_audio_stream_callback asc, void *(*func)(void *), void *arg)
+{
+    cst_audio_streaming_info *asi = NULL;
+    thread_queue_entry_t entry;
+    cst_voice *v;
+    int sample_rate = sample_rate_option(opts);
+    VALUE stats = speech_stats_option(opts);
+    speech_call_t call;
+    double start_time;
+    voice_acquire_arg_t vaa;
+    int state = 0;
 
-#endif
+    speech_limits_init(vsd, opts);
+    vsd->asc = encoder->asc;
+    if (encoder->encoder_init) {
+        vsd->encoder = encoder->encoder_init(opts);
+    }
+    if (sample_rate != 0) {
+        vsd->resampler = resampler_new(sample_rate, asc);
+        if (vsd->resampler == NULL) {
+            if (encoder->encoder_fini) {
+                encoder->encoder_fini(vsd->encoder);
+            }
+            rb_raise(rb_eNoMemError, "failed to allocate resampler");
+        }
+        asc = resampler_cb;
+    }
+
+    start_time = monotonic_time();
+    vaa.self = self;
+    vaa.entry = &entry;
+    rb_protect(voice_acquire_body, (VALUE)&vaa, &state);
+    vsd->stats.queue_wait = monotonic_time() - start_time;
+    if (state != 0) {
+        /* Flite::BusyError or an exception raised while waiting */
+        if (encoder->encoder_fini) {
+            encoder->encoder_fini(vsd->encoder);
+        }
+        resampler_free(vsd->resampler);
+        vsd->resampler = NULL;
+        vsd->state = state;
+        speech_stats_report(self, vsd, stats);
+        rb_jump_tag(state);
+    }
+    v = vaa.voice;
+    vsd->voice = v;
+
+    /* write to an object */
+    asi = new_audio_streaming_info();
+    if (asi == NULL) {
+        voice_release(self, v);
+        if (encoder->encoder_fini) {
+            encoder->encoder_fini(vsd->encoder);
+        }
+        resampler_free(vsd->resampler);
+        vsd->resampler = NULL;
+        rb_raise(rb_eNoMemError, "failed to allocate audio_streaming_info");
+    }
+    vsd->stream_asc = asc;
+    asi->asc = stream_guard_cb;
+    asi->userdata = (void*)vsd;
+
+    flite_feat_set(v->features, "streaming_info", audio_streaming_info_val(asi));
+    call.func = func;
+    call.arg = arg;
+    start_time = monotonic_time();
+    speech_call_run(&call, vsd, 1);
+    vsd->stats.synthesis_time = monotonic_time() - start_time;
+    flite_feat_remove(v->features, "streaming_info");
+
+    voice_release(self, v);
+
+    if (encoder->encoder_fini) {
+        encoder->encoder_fini(vsd->encoder);
+    }
+    resampler_free(vsd->resampler);
+    vsd->resampler = NULL;
+    speech_stats_report(self, vsd, stats);
+}
 
 /*
  * @overload speak(text)
@@ -611,29 +4776,39 @@ rbflite_voice_speak(VALUE self, VALUE text)
     rbflite_voice_t *voice = DATA_PTR(self);
     voice_speech_data_t vsd;
     thread_queue_entry_t entry;
+    speech_call_t call;
+    struct timeval sleep_time;
+    double start_time;
 
     if (voice->voice == NULL) {
         rb_raise(rb_eFliteRuntimeError, "%s is not initialized", rb_obj_classname(self));
     }
 
-    vsd.voice = voice->voice;
-    vsd.text = StringValueCStr(text);
-    vsd.outtype = "play";
-    vsd.buffer_list = NULL;
-    vsd.buffer_list_last = NULL;
-    vsd.error = RBFLITE_ERROR_SUCCESS;
+    voice_speech_data_init(&vsd, voice->voice, StringValueCStr(text), "play");
 
-    lock_thread(&voice->queue, &entry);
+    start_time = monotonic_time();
+    vsd.voice = voice_acquire(self, &entry);
+    vsd.stats.queue_wait = monotonic_time() - start_time;
 
-    rb_thread_call_without_gvl(voice_speech_without_gvl, &vsd, NULL, NULL);
+    /* Audio playback cannot be stopped. Interrupts are checked after the lock is released. */
+    call.func = voice_speech_without_gvl;
+    call.arg = &vsd;
+    start_time = monotonic_time();
+    speech_call_run(&call, &vsd, 0);
+    vsd.stats.synthesis_time = monotonic_time() - start_time;
     RB_GC_GUARD(text);
 
-    unlock_thread(&voice->queue);
+    voice_release(self, vsd.voice);
+    speech_stats_report(self, &vsd, Qnil);
+    rb_thread_check_ints();
 
     check_error(&vsd);
 
-    if (sleep_time_after_speaking.tv_sec != 0 || sleep_time_after_speaking.tv_usec != 0) {
-        rb_thread_wait_for(sleep_time_after_speaking);
+    SHARED_LOCK(settings_mutex);
+    sleep_time = sleep_time_after_speaking;
+    SHARED_UNLOCK(settings_mutex);
+    if (sleep_time.tv_sec != 0 || sleep_time.tv_usec != 0) {
+        rb_thread_wait_for(sleep_time);
     }
 
     return self;
@@ -655,6 +4830,14 @@ rbflite_voice_speak(VALUE self, VALUE text)
  *    File.binwrite('hello_flite_world.raw',
  *                  voice.to_speech('Hello Flite World!', :raw))
  *
+ *    # Save speech as raw pcm (32 bit float big endian, rate 8000 Hz, mono)
+ *    File.binwrite('hello_flite_world.raw',
+ *                  voice.to_speech('Hello Flite World!', :raw, :format => :float32, :endian => :big))
+ *
+ *    # Save speech as 24 bit wav
+ *    File.binwrite('hello_flite_world.wav',
+ *                  voice.to_speech('Hello Flite World!', :wav, :format => :int24))
+ *
  *    # Save speech as mp3
  *    File.binwrite('hello_flite_world.mp3',
  *                  voice.to_speech('Hello Flite World!', :mp3))
@@ -663,9 +4846,94 @@ rbflite_voice_speak(VALUE self, VALUE text)
  *    File.binwrite('hello_flite_world.mp3',
  *                  voice.to_speech('Hello Flite World!', :mp3, :bitrate => 128))
  *
+ *    # Write speech to a socket while it is synthesized.
+ *    voice.to_speech('Hello Flite World!', :mp3) do |chunk|
+ *      socket.write(chunk)
+ *    end
+ *
+ *    # Save speech as flac with the best compression.
+ *    File.binwrite('hello_flite_world.flac',
+ *                  voice.to_speech('Hello Flite World!', :flac, :compression_level => 8))
+ *
+ *    # Save speech as G.711 mu-law in a WAVE file.
+ *    File.binwrite('hello_flite_world.wav',
+ *                  voice.to_speech('Hello Flite World!', :ulaw, :container => :wav))
+ *
+ *    # Save speech as Ogg Opus whose bitrate is 16k and frame size is 40 ms.
+ *    File.binwrite('hello_flite_world.opus',
+ *                  voice.to_speech('Hello Flite World!', :opus, :bitrate => 16, :frame_size => 40))
+ *
+ *    # Encode mp3 by another thread while the speech is synthesized.
+ *    voice.to_speech(File.read('long_story.txt'), :mp3, :pipeline => true)
+ *
+ *    # Synthesize a long text by 4 threads.
+ *    voice.to_speech(File.read('long_story.txt'), :mp3, :parallel => 4)
+ *
+ *    # Save speech as wav whose sample rate is 48000 Hz.
+ *    File.binwrite('hello_flite_world.wav',
+ *                  voice.to_speech('Hello Flite World!', :wav, :sample_rate => 48000))
+ *
+ *  When a block is given, encoded audio data are passed to the block
+ *  chunk by chunk while the speech is synthesized and this returns
+ *  <code>self</code>. The synthesis waits until the block returns.
+ *  Don't use the same voice in the block.
+ *
+ *  When <code>:pipeline</code> in <code>opts</code> is true for mp3,
+ *  audio data are passed to an encoder thread through a ring buffer
+ *  and synthesis and encoding run concurrently. It is ignored when a
+ *  block is given.
+ *
+ *  When <code>:parallel</code> in <code>opts</code> is an integer, the
+ *  text is split at sentence boundaries into at most that number of
+ *  pieces, which are synthesized by native threads concurrently.
+ *  <code>true</code> means the number of processors, which is also
+ *  the upper limit of the integer. The audio data
+ *  of the pieces are concatenated in order and encoded as one stream.
+ *  Short texts aren't split. This is available when the voice data
+ *  can be shared by voice instances (CMU Flite 2.0.0 or upper).
+ *
+ *  <code>:format</code> in <code>opts</code> for :wav and :raw is
+ *  <code>:int16</code> (default), <code>:int24</code> or
+ *  <code>:float32</code>. <code>:endian</code> for :raw is
+ *  <code>:little</code>, <code>:big</code> or <code>:native</code>
+ *  (default). Audio data in wav are always little endian.
+ *
+ *  When <code>:sample_rate</code> in <code>opts</code> is set, the
+ *  synthesized audio data are resampled to the rate before they are
+ *  encoded. It is also available in {#to_speech_batch}, {#to_speech_io}
+ *  and the encoder options of {#to_speech_multi}.
+ *
+ *  When <code>:timeout</code> in <code>opts</code> is set, synthesis
+ *  is stopped and {Flite::TimeoutError} is raised if it doesn't finish
+ *  within the seconds. When <code>:max_bytes</code> is set,
+ *  {Flite::OutputLimitError} is raised as soon as the audio data
+ *  exceed the size. Both are checked between chunks of audio data.
+ *  Synthesis is also stopped by Thread#raise, Thread#kill and
+ *  Timeout.timeout.
+ *
+ *  In a non-blocking fiber (when Fiber.scheduler is set, Ruby 3.0 or
+ *  upper), synthesis runs in a worker thread and the fiber waits for
+ *  it through the fiber scheduler, so other fibers keep running. The
+ *  block is called by the fiber. Waiting for the voice used by other
+ *  fibers or threads doesn't block the thread either. This also
+ *  applies to {#speak}, {#to_speech_batch}, {#to_speech_io} and
+ *  {#to_speech_multi}.
+ *
+ *  When a Hash is passed as <code>:stats</code> in <code>opts</code>,
+ *  statistics of the call are stored to it even when an exception is
+ *  raised. The keys are the same as {#stats} except
+ *  <code>:calls</code> and <code>:errors</code>. This is also
+ *  available in the <code>opts</code> of {#to_speech_batch},
+ *  {#to_speech_io} and {#to_speech_multi}.
+ *
+ *    stats = {}
+ *    voice.to_speech('Hello Flite World!', :mp3, :stats => stats)
+ *    stats[:real_time_factor] # => 0.05
+ *
  *  @param [String] text
- *  @param [Symbol] audo_type :wav, :raw or :mp3 (when mp3 support is enabled)
- *  @param [Hash]   opts  audio encoder options
+ *  @param [Symbol] audo_type :wav, :raw, :flac, :ulaw, :alaw, :mp3 or :opus (when mp3 or opus support is enabled)
+ *  @param [Hash]   opts  audio encoder options, <code>:sample_rate</code>, <code>:timeout</code>, <code>:max_bytes</code>, <code>:parallel</code> and <code>:stats</code>
+ *  @yieldparam [String] chunk audio data
  *  @return [String] audio data
  *  @see Flite.supported_audio_types
  */
@@ -676,14 +4944,12 @@ rbflite_voice_to_speech(int argc, VALUE *argv, VALUE self)
     VALUE text;
     VALUE audio_type;
     VALUE opts;
-    cst_audio_streaming_info *asi = NULL;
     audio_stream_encoder_t *encoder;
     voice_speech_data_t vsd;
-    thread_queue_entry_t entry;
-    buffer_list_t *list, *list_next;
-    size_t size;
+    int yield_chunks = rb_block_given_p();
+    cst_audio_stream_callback asc;
+    void *(*func)(void *) = voice_speech_without_gvl;
     VALUE speech_data;
-    char *ptr;
 
     if (voice->voice == NULL) {
         rb_raise(rb_eFliteRuntimeError, "%s is not initialized", rb_obj_classname(self));
@@ -691,75 +4957,354 @@ rbflite_voice_to_speech(int argc, VALUE *argv, VALUE self)
 
     rb_scan_args(argc, argv, "12", &text, &audio_type, &opts);
 
-    if (NIL_P(audio_type)) {
-        encoder = &wav_encoder;
-    } else {
-        if (rb_equal(audio_type, sym_wav)) {
-            encoder = &wav_encoder;
-        } else if (rb_equal(audio_type, sym_raw)) {
-            encoder = &raw_encoder;
-#ifdef HAVE_MP3LAME
-        } else if (rb_equal(audio_type, sym_mp3)) {
-            encoder = &mp3_encoder;
+    encoder = audio_type_to_encoder(audio_type);
+    voice_speech_data_init(&vsd, voice->voice, StringValueCStr(text), "stream");
+    vsd.yield_chunks = yield_chunks;
+    asc = yield_chunks ? yield_encoder_cb : encoder->asc;
+
+#ifdef HAVE_PARALLEL_SPEECH
+    if (RB_TYPE_P(opts, T_HASH) && voice->cache_entry != NULL) {
+        VALUE parallel = rb_hash_aref(opts, ID2SYM(rb_intern("parallel")));
+        int num_threads = 1;
+
+        if (parallel == Qtrue) {
+            num_threads = num_processors();
+        } else if (RTEST(parallel)) {
+            num_threads = NUM2INT(parallel);
+            if (num_threads < 0) {
+                rb_raise(rb_eArgError, "parallel must not be negative");
+            }
+            /* more threads than processors don't make synthesis faster. */
+            num_threads = MIN(num_threads, num_processors());
+        }
+        /* split_text() doesn't make pieces shorter than MIN_SPEECH_PIECE_LEN. */
+        num_threads = (int)MIN((long)num_threads, RSTRING_LEN(text) / MIN_SPEECH_PIECE_LEN + 1);
+        if (num_threads > 1) {
+            VALUE offsets_buf;
+            long *offsets = ALLOCV_N(long, offsets_buf, num_threads + 1);
+            voice_speech_parallel_t vsp;
+
+            /* keep the text from being modified by other threads. */
+            text = rb_str_new_frozen(text);
+            vsd.text = StringValueCStr(text);
+            vsp.num_pieces = split_text(vsd.text, RSTRING_LEN(text), num_threads, offsets);
+            if (vsp.num_pieces > 1) {
+                vsp.vsd = &vsd;
+                vsp.voice = voice->cache_entry->voice;
+                vsp.offsets = offsets;
+                voice_stream_speech(self, &vsd, encoder, opts, asc,
+                                    voice_speech_parallel_without_gvl, &vsp);
+                func = NULL;
+            }
+            ALLOCV_END(offsets_buf);
+        }
+    }
 #endif
-        } else {
-            rb_raise(rb_eArgError, "unknown audio type");
+    if (func != NULL) {
+        voice_stream_speech(self, &vsd, encoder, opts, asc, func, &vsd);
+    }
+    RB_GC_GUARD(text);
+
+    check_error(&vsd);
+
+    speech_data = speech_data_finish(&vsd);
+    if (yield_chunks) {
+        if (RSTRING_LEN(speech_data) > 0) {
+            rb_yield(speech_data);
         }
+        return self;
     }
+    return speech_data;
+}
+
+/*
+ * @overload to_speech_batch(texts, audio_type = :wav, opts = {})
+ *
+ *  Converts each text in <code>texts</code> to audio data.
+ *
+ *  This is faster than calling {#to_speech} for each text, especially
+ *  for many short texts. The encoder, the voice lock and the streaming
+ *  setup are prepared only once and all texts are converted without
+ *  the GVL.
+ *
+ *  @example
+ *    voice = Flite::Voice.new
+ *
+ *    # Get an array of audio data.
+ *    prompts = ['Hello', 'Good bye']
+ *    voice.to_speech_batch(prompts, :mp3).each_with_index do |data, idx|
+ *      File.binwrite("prompt#{idx}.mp3", data)
+ *    end
+ *
+ *    # Get each audio data as soon as it is converted.
+ *    idx = 0
+ *    voice.to_speech_batch(prompts, :mp3) do |data|
+ *      File.binwrite("prompt#{idx}.mp3", data)
+ *      idx += 1
+ *    end
+ *
+ *  @param [Array<String>] texts
+ *  @param [Symbol] audo_type :wav, :raw, :flac, :ulaw, :alaw, :mp3 or :opus (when mp3 or opus support is enabled)
+ *  @param [Hash]   opts  audio encoder options, <code>:sample_rate</code>, <code>:timeout</code>, <code>:max_bytes</code> and <code>:stats</code>
+ *  @yieldparam [String] data audio data of each text
+ *  @return [Array<String>] audio data in the order of <code>texts</code>,
+ *    or <code>self</code> when a block is given
+ *  @see Flite.supported_audio_types
+ */
+static VALUE
+rbflite_voice_to_speech_batch(int argc, VALUE *argv, VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+    VALUE texts;
+    VALUE audio_type;
+    VALUE opts;
+    audio_stream_encoder_t *encoder;
+    voice_speech_batch_t vsb;
+    VALUE texts_buf;
+    VALUE indexes_buf;
+    VALUE sizes_buf;
+    VALUE result;
+    long i;
 
-    vsd.voice = voice->voice;
-    vsd.text = StringValueCStr(text);
-    vsd.outtype = "stream";
-    vsd.encoder = NULL;
-    vsd.buffer_list = NULL;
-    vsd.buffer_list_last = NULL;
-    vsd.error = RBFLITE_ERROR_SUCCESS;
+    if (voice->voice == NULL) {
+        rb_raise(rb_eFliteRuntimeError, "%s is not initialized", rb_obj_classname(self));
+    }
 
-    if (encoder->encoder_init) {
-        vsd.encoder = encoder->encoder_init(opts);
+    rb_scan_args(argc, argv, "12", &texts, &audio_type, &opts);
+
+    encoder = audio_type_to_encoder(audio_type);
+
+    /* keep frozen texts to prevent them from being modified by other threads. */
+    texts = rb_ary_dup(rb_convert_type(texts, T_ARRAY, "Array", "to_ary"));
+    vsb.num_texts = RARRAY_LEN(texts);
+    vsb.texts = ALLOCV_N(const char *, texts_buf, vsb.num_texts);
+    vsb.indexes = ALLOCV_N(long, indexes_buf, vsb.num_texts);
+    vsb.sizes = ALLOCV_N(size_t, sizes_buf, vsb.num_texts);
+    for (i = 0; i < vsb.num_texts; i++) {
+        VALUE text = rb_str_new_frozen(rb_String(rb_ary_entry(texts, i)));
+        rb_ary_store(texts, i, text);
+        vsb.texts[i] = StringValueCStr(text);
     }
+    vsb.done = 0;
+    vsb.yield_each = rb_block_given_p();
 
-    /* write to an object */
-    asi = new_audio_streaming_info();
-    if (asi == NULL) {
-        if (encoder->encoder_fini) {
-            encoder->encoder_fini(vsd.encoder);
+    voice_speech_data_init(&vsb.vsd, voice->voice, NULL, "stream");
+    if (!vsb.yield_each) {
+        vsb.vsd.speech_data_list = rb_ary_new();
+    }
+    voice_stream_speech(self, &vsb.vsd, encoder, opts, encoder->asc,
+                        voice_speech_batch_without_gvl, &vsb);
+    RB_GC_GUARD(texts);
+
+    check_error(&vsb.vsd);
+
+    if (vsb.yield_each) {
+        result = self;
+    } else {
+        VALUE list = vsb.vsd.speech_data_list;
+
+        result = rb_ary_new2(vsb.num_texts);
+        for (i = 0; i < vsb.num_texts; i++) {
+            VALUE speech_data;
+
+            if (vsb.indexes[i] == -1) {
+                speech_data = rb_str_new(NULL, 0);
+            } else {
+                speech_data = rb_ary_entry(list, vsb.indexes[i]);
+                rb_str_set_len(speech_data, vsb.sizes[i]);
+                rb_str_resize(speech_data, vsb.sizes[i]);
+            }
+            rb_ary_push(result, speech_data);
         }
-        rb_raise(rb_eNoMemError, "failed to allocate audio_streaming_info");
+        RB_GC_GUARD(list);
     }
-    asi->asc = encoder->asc;
-    asi->userdata = (void*)&vsd;
+    ALLOCV_END(texts_buf);
+    ALLOCV_END(indexes_buf);
+    ALLOCV_END(sizes_buf);
+    return result;
+}
+
+/*
+ * @overload to_speech_multi(text, formats, opts = {})
+ *
+ *  Converts <code>text</code> to audio data in several formats at once.
+ *
+ *  The text is synthesized only once and each chunk of synthesized
+ *  audio data is passed to the encoders of all formats. This is
+ *  faster than calling {#to_speech} for each format.
+ *
+ *  @example
+ *    voice = Flite::Voice.new
+ *
+ *    data = voice.to_speech_multi('Hello Flite World!',
+ *                                 :wav => {}, :mp3 => {:bitrate => 64},
+ *                                 :ulaw => {:sample_rate => 8000})
+ *    File.binwrite('hello_flite_world.wav', data[:wav])
+ *    File.binwrite('hello_flite_world.mp3', data[:mp3])
+ *    File.binwrite('hello_flite_world.ulaw', data[:ulaw])
+ *
+ *  @param [String] text
+ *  @param [Hash]   formats  audio types as keys and their encoder options as values
+ *  @param [Hash]   opts  <code>:timeout</code> and <code>:stats</code>. <code>:max_bytes</code> in
+ *    <code>formats</code> limits the size of audio data of each format.
+ *  @return [Hash] audio types as keys and audio data as values
+ *  @see Flite.supported_audio_types
+ */
+static VALUE
+rbflite_voice_to_speech_multi(int argc, VALUE *argv, VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+    VALUE text;
+    VALUE formats;
+    VALUE opts;
+    voice_speech_multi_t vsm;
+    VALUE types;
+    VALUE targets_buf;
+    VALUE list;
+    VALUE result;
+    int state = 0;
+    long i;
 
-    lock_thread(&voice->queue, &entry);
+    if (voice->voice == NULL) {
+        rb_raise(rb_eFliteRuntimeError, "%s is not initialized", rb_obj_classname(self));
+    }
 
-    flite_feat_set(voice->voice->features, "streaming_info", audio_streaming_info_val(asi));
-    rb_thread_call_without_gvl(voice_speech_without_gvl, &vsd, NULL, NULL);
-    flite_feat_remove(voice->voice->features, "streaming_info");
-    RB_GC_GUARD(text);
+    rb_scan_args(argc, argv, "21", &text, &formats, &opts);
+    formats = rb_convert_type(formats, T_HASH, "Hash", "to_hash");
+    types = rb_funcall(formats, rb_intern("keys"), 0);
+    if (RARRAY_LEN(types) == 0) {
+        rb_raise(rb_eArgError, "no audio types");
+    }
 
-    unlock_thread(&voice->queue);
+    voice_speech_data_init(&vsm.vsd, voice->voice, StringValueCStr(text), "stream");
+    vsm.num_targets = RARRAY_LEN(types);
+    vsm.num_initialized = 0;
+    vsm.targets = ALLOCV_N(speech_target_t, targets_buf, vsm.num_targets);
+    /* keep strings written by encoders from being garbage-collected. */
+    list = rb_ary_new();
+    for (i = 0; i < vsm.num_targets; i++) {
+        speech_target_t *target = &vsm.targets[i];
+        VALUE type = rb_ary_entry(types, i);
 
-    if (encoder->encoder_fini) {
-        encoder->encoder_fini(vsd.encoder);
+        target->encoder = audio_type_to_encoder(type);
+        target->opts = rb_hash_aref(formats, type);
+        voice_speech_data_init(&target->vsd, voice->voice, vsm.vsd.text, "stream");
+        target->vsd.owner = &vsm.vsd;
+        target->vsd.speech_data_list = list;
+        speech_limits_init(&target->vsd, target->opts);
     }
+    /* check opts before the encoders are created. voice_stream_speech() doesn't clean them up on errors in opts. */
+    sample_rate_option(opts);
+    speech_stats_option(opts);
+    speech_limits_init(&vsm.vsd, opts);
 
-    check_error(&vsd);
+    rb_protect(speech_multi_init_encoders, (VALUE)&vsm, &state);
+    if (state != 0) {
+        speech_multi_fini_encoders(&vsm);
+        rb_jump_tag(state);
+    }
 
-    size = 0;
-    for (list = vsd.buffer_list; list != NULL; list = list->next) {
-        size += list->used;
+    /* The encoders are finalized by multi_encoder_fini even when an exception is raised. */
+    vsm.vsd.encoder = &vsm;
+    voice_stream_speech(self, &vsm.vsd, &multi_encoder, opts, multi_encoder_cb,
+                        voice_speech_without_gvl, &vsm.vsd);
+    RB_GC_GUARD(text);
+
+    check_error(&vsm.vsd);
+    for (i = 0; i < vsm.num_targets; i++) {
+        check_error(&vsm.targets[i].vsd);
     }
-    speech_data = rb_str_buf_new(size);
-    ptr = RSTRING_PTR(speech_data);
-    for (list = vsd.buffer_list; list != NULL; list = list_next) {
-        memcpy(ptr, list->buf, list->used);
-        ptr += list->used;
-        list_next = list->next;
-        xfree(list);
+    result = rb_hash_new();
+    for (i = 0; i < vsm.num_targets; i++) {
+        rb_hash_aset(result, rb_ary_entry(types, i), speech_data_finish(&vsm.targets[i].vsd));
     }
-    rb_str_set_len(speech_data, size);
+    RB_GC_GUARD(formats);
+    RB_GC_GUARD(list);
+    ALLOCV_END(targets_buf);
+    return result;
+}
 
-    return speech_data;
+/*
+ * @overload to_speech_io(text, io, audio_type = :wav, opts = {})
+ *
+ *  Converts <code>text</code> to audio data and writes it to <code>io</code>.
+ *
+ *  Audio data are written to the file descriptor of <code>io</code>
+ *  directly while the speech is synthesized without the GVL. They
+ *  aren't stored in memory. When the audio type is :wav and
+ *  <code>io</code> is seekable and not in append mode, the WAVE header
+ *  is fixed after synthesis if the data size differs from the one in
+ *  the header.
+ *
+ *  @example
+ *    voice = Flite::Voice.new
+ *
+ *    # Save speech as wav
+ *    File.open('hello_flite_world.wav', 'wb') do |f|
+ *      voice.to_speech_io('Hello Flite World!', f)
+ *    end
+ *
+ *    # Send speech as mp3 to a socket
+ *    voice.to_speech_io('Hello Flite World!', socket, :mp3)
+ *
+ *  @param [String] text
+ *  @param [IO]     io
+ *  @param [Symbol] audo_type :wav, :raw, :flac, :ulaw, :alaw, :mp3 or :opus (when mp3 or opus support is enabled)
+ *  @param [Hash]   opts  audio encoder options, <code>:sample_rate</code>, <code>:timeout</code>, <code>:max_bytes</code> and <code>:stats</code>
+ *  @return [Integer] number of bytes written
+ *  @see Flite.supported_audio_types
+ */
+static VALUE
+rbflite_voice_to_speech_io(int argc, VALUE *argv, VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+    VALUE text;
+    VALUE io;
+    VALUE audio_type;
+    VALUE opts;
+    audio_stream_encoder_t *encoder;
+    voice_speech_data_t vsd;
+    rb_io_t *fptr;
+
+    if (voice->voice == NULL) {
+        rb_raise(rb_eFliteRuntimeError, "%s is not initialized", rb_obj_classname(self));
+    }
+
+    rb_scan_args(argc, argv, "22", &text, &io, &audio_type, &opts);
+
+    encoder = audio_type_to_encoder(audio_type);
+    voice_speech_data_init(&vsd, voice->voice, StringValueCStr(text), "stream");
+
+    io = rb_io_get_write_io(rb_io_get_io(io));
+    GetOpenFile(io, fptr);
+    rb_io_check_writable(fptr);
+    /* write data buffered in io before audio data. */
+    rb_io_flush(io);
+#ifdef HAVE_RB_IO_DESCRIPTOR
+    vsd.fd = rb_io_descriptor(io);
+#else
+    vsd.fd = fptr->fd;
+#endif
+
+    voice_stream_speech(self, &vsd, encoder, opts, encoder->asc, voice_speech_without_gvl, &vsd);
+    RB_GC_GUARD(text);
+    RB_GC_GUARD(io);
+
+    check_error(&vsd);
+
+#ifdef HAVE_PWRITE
+    if (vsd.wav_header_offset != -1) {
+        int data_size = (int)(vsd.written - vsd.wav_header.size);
+
+        if (data_size != vsd.wav_header.data_size) {
+            wav_header_set_data_size(&vsd.wav_header, data_size);
+            if (pwrite(vsd.fd, vsd.wav_header.bytes, vsd.wav_header.size, vsd.wav_header_offset) != vsd.wav_header.size) {
+                rb_sys_fail("pwrite");
+            }
+        }
+    }
+#endif
+    return SIZET2NUM(vsd.written);
 }
 
 /*
@@ -820,6 +5365,55 @@ rbflite_voice_pathname(VALUE self)
     return rb_usascii_str_new_cstr(pathname);
 }
 
+/*
+ * @overload stats
+ *
+ *  Returns cumulative statistics of calls on the voice. Times are
+ *  in seconds.
+ *
+ *  - <code>:calls</code> number of calls
+ *  - <code>:errors</code> number of calls which failed
+ *  - <code>:queue_wait</code> time waiting for other calls on the voice
+ *  - <code>:synthesis_time</code> wall-clock time of synthesis including encoding
+ *  - <code>:cpu_time</code> CPU time of threads synthesizing audio data
+ *    (0 when the platform doesn't provide it)
+ *  - <code>:encode_time</code> time spent to resample, encode and write
+ *    audio data, including the block of {#to_speech}
+ *  - <code>:duration</code> length of synthesized audio data
+ *  - <code>:real_time_factor</code> <code>:synthesis_time</code> divided
+ *    by <code>:duration</code>. nil when no audio data were synthesized.
+ *  - <code>:bytes</code> size of output audio data
+ *
+ *  @example
+ *    voice = Flite::Voice.new
+ *    voice.to_speech('Hello Flite World!', :mp3)
+ *    voice.stats
+ *    # => {:calls=>1, :errors=>0, :queue_wait=>1.2e-06, :synthesis_time=>0.061,
+ *    #     :cpu_time=>0.060, :encode_time=>0.011, :duration=>1.43,
+ *    #     :real_time_factor=>0.042, :bytes=>11493}
+ *
+ *  @return [Hash]
+ */
+static VALUE
+rbflite_voice_stats(VALUE self)
+{
+    rbflite_voice_t *voice = DATA_PTR(self);
+    VALUE hash = rb_hash_new();
+    unsigned long num_calls;
+    unsigned long num_errors;
+    speech_stats_t stats;
+
+    SHARED_LOCK(stats_mutex);
+    num_calls = voice->num_calls;
+    num_errors = voice->num_errors;
+    stats = voice->stats;
+    SHARED_UNLOCK(stats_mutex);
+    rb_hash_aset(hash, ID2SYM(rb_intern("calls")), ULONG2NUM(num_calls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("errors")), ULONG2NUM(num_errors));
+    speech_stats_set(hash, &stats);
+    return hash;
+}
+
 /*
  * @overload inspect
  *
@@ -858,13 +5452,28 @@ Init_flite(void)
 {
     VALUE cmu_flite_version;
 
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    /* Process-wide state is protected by native mutexes. */
+    rb_ext_ractor_safe(true);
+#endif
+
+    sym_flac = ID2SYM(rb_intern("flac"));
+    sym_ulaw = ID2SYM(rb_intern("ulaw"));
+    sym_alaw = ID2SYM(rb_intern("alaw"));
     sym_mp3 = ID2SYM(rb_intern("mp3"));
+    sym_opus = ID2SYM(rb_intern("opus"));
     sym_raw = ID2SYM(rb_intern("raw"));
     sym_wav = ID2SYM(rb_intern("wav"));
 
     rb_mFlite = rb_define_module("Flite");
     rb_eFliteError = rb_define_class_under(rb_mFlite, "Error", rb_eStandardError);
     rb_eFliteRuntimeError = rb_define_class_under(rb_mFlite, "RuntimeError", rb_eFliteError);
+    rb_eFliteBusyError = rb_define_class_under(rb_mFlite, "BusyError", rb_eFliteError);
+    rb_eFliteTimeoutError = rb_define_class_under(rb_mFlite, "TimeoutError", rb_eFliteError);
+    rb_eFliteOutputLimitError = rb_define_class_under(rb_mFlite, "OutputLimitError", rb_eFliteError);
+#ifdef HAVE_FIBER_SCHEDULER
+    rb_cSizedQueue = rb_path2class("Thread::SizedQueue");
+#endif
 
     cmu_flite_version = rb_usascii_str_new_cstr(FLITE_PROJECT_VERSION);
     OBJ_FREEZE(cmu_flite_version);
@@ -886,13 +5495,40 @@ Init_flite(void)
     rb_define_singleton_method(rb_mFlite, "list_builtin_voices", flite_s_list_builtin_voices, 0);
     rb_define_singleton_method(rb_mFlite, "supported_audio_types", flite_s_supported_audio_types, 0);
     rb_define_singleton_method(rb_mFlite, "sleep_time_after_speaking=", flite_s_set_sleep_time_after_speaking, 1);
+    rb_define_singleton_method(rb_mFlite, "cached_voices", flite_s_cached_voices, 0);
+    rb_define_singleton_method(rb_mFlite, "evict_cached_voice", flite_s_evict_cached_voice, 1);
+    rb_define_singleton_method(rb_mFlite, "clear_voice_cache", flite_s_clear_voice_cache, 0);
+#ifdef HAVE_NATIVE_THREAD
+    native_mutex_init(&settings_mutex);
+    native_mutex_init(&voice_cache_mutex);
+    native_mutex_init(&stats_mutex);
+#endif
+    flac_crc_init();
+#ifdef HAVE_OPUS
+    ogg_crc_init();
+#endif
+#ifdef HAVE_MP3_POOL
+    native_mutex_init(&mp3_pool_mutex);
+    rb_define_singleton_method(rb_mFlite, "mp3_encoder_pool_stats", flite_s_mp3_encoder_pool_stats, 0);
+    rb_define_singleton_method(rb_mFlite, "mp3_encoder_pool_max_size=", flite_s_set_mp3_encoder_pool_max_size, 1);
+#endif
     rb_cVoice = rb_define_class_under(rb_mFlite, "Voice", rb_cObject);
     rb_define_alloc_func(rb_cVoice, rbflite_voice_s_allocate);
 
     rb_define_method(rb_cVoice, "initialize", rbflite_voice_initialize, -1);
     rb_define_method(rb_cVoice, "speak", rbflite_voice_speak, 1);
     rb_define_method(rb_cVoice, "to_speech", rbflite_voice_to_speech, -1);
+    rb_define_method(rb_cVoice, "to_speech_io", rbflite_voice_to_speech_io, -1);
+    rb_define_method(rb_cVoice, "to_speech_batch", rbflite_voice_to_speech_batch, -1);
+    rb_define_method(rb_cVoice, "to_speech_multi", rbflite_voice_to_speech_multi, -1);
     rb_define_method(rb_cVoice, "name", rbflite_voice_name, 0);
     rb_define_method(rb_cVoice, "pathname", rbflite_voice_pathname, 0);
+    rb_define_method(rb_cVoice, "stats", rbflite_voice_stats, 0);
+    rb_define_method(rb_cVoice, "max_waiters", rbflite_voice_get_max_waiters, 0);
+    rb_define_method(rb_cVoice, "max_waiters=", rbflite_voice_set_max_waiters, 1);
+    rb_define_method(rb_cVoice, "max_wait", rbflite_voice_get_max_wait, 0);
+    rb_define_method(rb_cVoice, "max_wait=", rbflite_voice_set_max_wait, 1);
+    rb_define_method(rb_cVoice, "queue_length", rbflite_voice_queue_length, 0);
+    rb_define_method(rb_cVoice, "busy?", rbflite_voice_busy_p, 0);
     rb_define_method(rb_cVoice, "inspect", rbflite_voice_inspect, 0);
 }
@@ -56,6 +56,7 @@
 /* flite.dll */
 typedef cst_val *(*audio_streaming_info_val_t)(const cst_audio_streaming_info *);
 typedef void (*delete_voice_t)(cst_voice *);
+typedef int (*feat_link_into_t)(const cst_features *, cst_features *);
 typedef int (*flite_add_lang_t)(const char *, void (*)(cst_voice *), cst_lexicon *(*)());
 typedef int (*flite_feat_remove_t)(cst_features *, const char *);
 typedef void (*flite_feat_set_t)(cst_features *, const char *, const cst_val *);
@@ -63,6 +64,7 @@ typedef const char *(*flite_get_param_string_t)(const cst_features *, const char
 typedef float (*flite_text_to_speech_t)(const char *, cst_voice *, const char *);
 typedef cst_voice *(*flite_voice_load_t)(const char *);
 typedef cst_audio_streaming_info *(*new_audio_streaming_info_t)();
+typedef cst_voice *(*new_voice_t)();
 
 /* flite_usenglish.dll */
 typedef void (*usenglish_init_t)(cst_voice *);
@@ -89,6 +91,7 @@ typedef int (*lame_encode_buffer_t)(lame_global_flags *, const short int *, cons
 typedef int (*lame_encode_flush_t)(lame_global_flags *, unsigned char *, int);
 typedef lame_global_flags *(*lame_init_t)(void);
 typedef int (*lame_init_params_t)(lame_global_flags *);
+typedef int (*lame_init_bitstream_t)(lame_global_flags *);
 typedef int (*lame_set_bWriteVbrTag_t)(lame_global_flags *, int);
 typedef int (*lame_set_brate_t)(lame_global_flags *, int);
 typedef int (*lame_set_in_samplerate_t)(lame_global_flags *, int);
@@ -262,6 +265,12 @@ void delete_voice(cst_voice *u)
     CALL_FUNC0(flite, delete_voice, (u));
 }
 
+/* flite.dll */
+int feat_link_into(const cst_features *from, cst_features *to)
+{
+    CALL_FUNC(flite, feat_link_into, (from, to), int);
+}
+
 /* flite.dll */
 int flite_add_lang(const char *langname, void (*lang_init)(cst_voice *vox), cst_lexicon *(*lex_init)())
 {
@@ -304,6 +313,12 @@ cst_audio_streaming_info *new_audio_streaming_info()
     CALL_FUNC(flite, new_audio_streaming_info, (), cst_audio_streaming_info *);
 }
 
+/* flite.dll */
+cst_voice *new_voice()
+{
+    CALL_FUNC(flite, new_voice, (), cst_voice *);
+}
+
 /* flite_usenglish.dll */
 void usenglish_init(cst_voice *v)
 {
@@ -375,6 +390,11 @@ int lame_init_params(lame_global_flags *gf)
     CALL_LAME_FUNC(lame_init_params, (gf), int);
 }
 
+int lame_init_bitstream(lame_global_flags *gf)
+{
+    CALL_LAME_FUNC(lame_init_bitstream, (gf), int);
+}
+
 int lame_set_bWriteVbrTag(lame_global_flags *gf, int bWriteVbrTag)
 {
     CALL_LAME_FUNC(lame_set_bWriteVbrTag, (gf, bWriteVbrTag), int);
@@ -34,29 +34,45 @@
 require "flite/version"
 RUBY_VERSION =~ /(\d+).(\d+)/
 require "flite_#{$1}#{$2}0"
+require "flite/voice_pool"
+require "flite/cache"
+require "flite/disk_cache"
+require "flite/parallel"
 
 module Flite
-  # @private
-  @@default_voice = Flite::Voice.new
+  if defined? Ractor
+    # Returns the voice used by {String#speak} and {String#to_speech}.
+    # Each Ractor has its own default voice.
+    #
+    # @return [Flite::Voice]
+    def self.default_voice
+      Ractor.current[:flite_default_voice] ||= Flite::Voice.new
+    end
+  else
+    # @private
+    @@default_voice = Flite::Voice.new
 
-  # Returns the voice used by {String#speak} and {String#to_speech}.
-  #
-  # @return [Flite::Voice]
-  def self.default_voice
-    @@default_voice
+    # Returns the voice used by {String#speak} and {String#to_speech}.
+    #
+    # @return [Flite::Voice]
+    def self.default_voice
+      @@default_voice
+    end
   end
 
   # Set the voice used by {String#speak} and {String#to_speech}.
   # When <code>name</code> is a {Flite::Voice}, use it.
   # Otherwise, use a new voice created by <code>Flite::Voice.new(name)</code>.
+  # It is set to the current Ractor only when Ractor is available.
   #
   # @param [Flite::Voice or String] name voice or voice name
   # @see Flite::Voice#initialize
   def self.default_voice=(name)
-    if name.is_a? Flite::Voice
-      @@default_voice = name
+    voice = name.is_a?(Flite::Voice) ? name : Flite::Voice.new(name)
+    if defined? Ractor
+      Ractor.current[:flite_default_voice] = voice
     else
-      @@default_voice = Flite::Voice.new(name)
+      @@default_voice = voice
     end
   end
 
@@ -93,9 +109,10 @@ class String
   #
   #  @param [Symbol] audo_type :wave or :mp3 (when mp3 support is enabled)
   #  @param [Hash]   opts  audio encoder options
+  #  @yieldparam [String] chunk audio data. See {Flite::Voice#to_speech}.
   #  @return [String] audio data
   #  @see Flite.supported_audio_types
-  def to_speech(*args)
-    Flite.default_voice.to_speech(self, *args)
+  def to_speech(*args, &block)
+    Flite.default_voice.to_speech(self, *args, &block)
   end
 end
@@ -0,0 +1,177 @@
+#
+# ruby-flite  -  a small speech synthesis library
+#   https://github.com/kubo/ruby-flite
+#
+# Copyright (C) 2015 Kubo Takehiro <kubo@jiubao.org>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#    1. Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#    2. Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials provided
+#       with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHORS ''AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+# BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+# OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+# IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# The views and conclusions contained in the software and documentation
+# are those of the authors and should not be interpreted as representing
+# official policies, either expressed or implied, of the authors.
+
+
+require 'thread'
+
+module Flite
+  # An in-process LRU cache of audio data converted by {Flite::Voice#to_speech}.
+  #
+  # Audio data are cached by voice, text, audio type and encoder options.
+  # The total size of cached audio data is limited by <code>:max_bytes</code>.
+  # When it is exceeded, least recently used data are evicted.
+  #
+  # Cached audio data are frozen and shared by callers.
+  #
+  # @example
+  #   cache = Flite::Cache.new(:max_bytes => 64 * 1024 * 1024)
+  #   voice = Flite::Voice.new('slt')
+  #
+  #   # Converted by voice.to_speech('Please hold.', :mp3)
+  #   data = cache.to_speech(voice, 'Please hold.', :mp3)
+  #   # Returned from the cache
+  #   data = cache.to_speech(voice, 'Please hold.', :mp3)
+  #
+  #   cache.stats # => {:hits=>1, :misses=>1, :evictions=>0, :entries=>1, :bytes=>4176}
+  class Cache
+    # @private
+    # Options of {Flite::Voice#to_speech} which don't change audio data.
+    # They aren't part of cache keys.
+    IGNORED_OPTIONS = [:stats, :timeout, :max_bytes, :parallel, :pipeline].freeze
+
+    # @private
+    # Returns <code>opts</code> without {IGNORED_OPTIONS}, or nil if nothing is left.
+    def self.output_options(opts)
+      opts = opts && opts.reject { |k, v| IGNORED_OPTIONS.include?(k) }
+      (opts.nil? || opts.empty?) ? nil : opts
+    end
+
+    # @return [Integer] the maximum total size of cached audio data
+    attr_reader :max_bytes
+
+    # Creates a new cache.
+    #
+    # @param [Hash] opts
+    # @option opts [Integer] :max_bytes the maximum total size of
+    #   cached audio data. The default is 16 MiB.
+    def initialize(opts = {})
+      @max_bytes = opts[:max_bytes] || 16 * 1024 * 1024
+      @mutex = Mutex.new
+      @entries = {}
+      @bytes = 0
+      @hits = 0
+      @misses = 0
+      @evictions = 0
+    end
+
+    # @overload to_speech(voice, text, audio_type = :wav, opts = {})
+    #
+    #  Returns audio data in the cache. If it isn't cached,
+    #  converts <code>text</code> by <code>voice</code> and
+    #  caches it.
+    #
+    #  Options which don't change audio data such as <code>:stats</code>
+    #  and <code>:timeout</code> aren't part of the cache key. They are
+    #  used only when <code>text</code> is converted, so the
+    #  <code>:stats</code> Hash is left untouched on a cache hit.
+    #
+    #  @param [Flite::Voice] voice
+    #  @param [String] text
+    #  @param [Symbol] audo_type
+    #  @param [Hash]   opts  audio encoder options
+    #  @return [String] frozen audio data
+    #  @see Flite::Voice#to_speech
+    def to_speech(voice, text, audio_type = :wav, opts = nil)
+      key_opts = Cache.output_options(opts)
+      key = [voice.name, voice.pathname, text.dup.freeze, audio_type, key_opts && key_opts.freeze].freeze
+      data = @mutex.synchronize do
+        data = @entries.delete(key)
+        if data
+          # move the entry to the most recently used position.
+          @entries[key] = data
+          @hits += 1
+        else
+          @misses += 1
+        end
+        data
+      end
+      return data if data
+
+      # Two threads may convert the same text at the same time.
+      # It is better than serializing all conversions.
+      data = voice.to_speech(text, audio_type, opts).freeze
+      store(key, data)
+      data
+    end
+
+    # Returns cache statistics.
+    #
+    # @return [Hash] counts of <code>:hits</code>, <code>:misses</code>
+    #   and <code>:evictions</code>, the number of cached <code>:entries</code>
+    #   and their total size in <code>:bytes</code>.
+    def stats
+      @mutex.synchronize do
+        {
+          :hits => @hits,
+          :misses => @misses,
+          :evictions => @evictions,
+          :entries => @entries.size,
+          :bytes => @bytes,
+        }
+      end
+    end
+
+    # Removes all cached audio data. Statistics counters are not reset.
+    def clear
+      @mutex.synchronize do
+        @entries.clear
+        @bytes = 0
+      end
+      self
+    end
+
+    # @private
+    def inspect
+      "#<#{self.class}: #{@entries.size} entries, #{@bytes}/#{@max_bytes} bytes>"
+    end
+
+    private
+
+    def store(key, data)
+      return if data.bytesize > @max_bytes
+      @mutex.synchronize do
+        old = @entries.delete(key)
+        @bytes -= old.bytesize if old
+        @entries[key] = data
+        @bytes += data.bytesize
+        while @bytes > @max_bytes
+          # the first entry is the least recently used one.
+          evicted_key, evicted_data = @entries.first
+          @entries.delete(evicted_key)
+          @bytes -= evicted_data.bytesize
+          @evictions += 1
+        end
+      end
+    end
+  end
+end
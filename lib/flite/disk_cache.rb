@@ -0,0 +1,179 @@
+#
+# ruby-flite  -  a small speech synthesis library
+#   https://github.com/kubo/ruby-flite
+#
+# Copyright (C) 2015 Kubo Takehiro <kubo@jiubao.org>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#    1. Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#    2. Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials provided
+#       with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHORS ''AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+# BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+# OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+# IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# The views and conclusions contained in the software and documentation
+# are those of the authors and should not be interpreted as representing
+# official policies, either expressed or implied, of the authors.
+
+
+require 'digest/sha2'
+require 'fileutils'
+require 'thread'
+require 'flite/cache'
+
+module Flite
+  # A persistent cache of audio data converted by {Flite::Voice#to_speech}.
+  #
+  # Audio data are stored in files named by the SHA-256 digest of voice,
+  # text, audio type, encoder options and the CMU Flite version. So the
+  # cache survives process restarts and a directory can be shared by
+  # multiple processes. Files are written to temporary names and renamed,
+  # so readers never see partially written data.
+  #
+  # Cached files are read by one read(2) call. When a file is read
+  # repeatedly, it is served from the OS page cache.
+  #
+  # @example
+  #   cache = Flite::DiskCache.new('/var/cache/flite')
+  #   voice = Flite::Voice.new('slt')
+  #
+  #   # Convert prompts at boot time.
+  #   cache.prewarm(voice, 'prompts.txt', :mp3)
+  #
+  #   data = cache.to_speech(voice, 'Please hold.', :mp3)
+  class DiskCache
+    # @private
+    FORMAT_VERSION = 1
+
+    # @return [String] the cache directory
+    attr_reader :dir
+
+    # Creates a new disk cache. The directory is created if it doesn't exist.
+    #
+    # @param [String] dir the cache directory
+    def initialize(dir)
+      @dir = File.expand_path(dir)
+      FileUtils.mkdir_p(@dir)
+      @mutex = Mutex.new
+      @hits = 0
+      @misses = 0
+    end
+
+    # @overload to_speech(voice, text, audio_type = :wav, opts = {})
+    #
+    #  Returns audio data in the cache. If it isn't cached,
+    #  converts <code>text</code> by <code>voice</code> and
+    #  stores it.
+    #
+    #  Options which don't change audio data such as <code>:stats</code>
+    #  and <code>:timeout</code> aren't part of the cache key. They are
+    #  used only when <code>text</code> is converted, so the
+    #  <code>:stats</code> Hash is left untouched on a cache hit.
+    #
+    #  @param [Flite::Voice] voice
+    #  @param [String] text
+    #  @param [Symbol] audo_type
+    #  @param [Hash]   opts  audio encoder options
+    #  @return [String] frozen audio data
+    #  @see Flite::Voice#to_speech
+    def to_speech(voice, text, audio_type = :wav, opts = nil)
+      path = path_for(voice, text, audio_type, opts)
+      begin
+        data = File.binread(path)
+        @mutex.synchronize { @hits += 1 }
+        return data.freeze
+      rescue Errno::ENOENT
+        @mutex.synchronize { @misses += 1 }
+      end
+      data = voice.to_speech(text, audio_type, opts)
+      store(path, data)
+      data.freeze
+    end
+
+    # Converts texts in <code>file</code>, one text per line, and stores
+    # them unless they are cached already. Empty lines are ignored.
+    #
+    # @param [Flite::Voice] voice
+    # @param [String] file path of a prompt list file
+    # @param [Symbol] audo_type
+    # @param [Hash]   opts  audio encoder options
+    # @return [Integer] number of texts converted
+    def prewarm(voice, file, audio_type = :wav, opts = nil)
+      converted = 0
+      File.foreach(file) do |line|
+        text = line.chomp
+        next if text.empty?
+        path = path_for(voice, text, audio_type, opts)
+        next if File.exist?(path)
+        store(path, voice.to_speech(text, audio_type, opts))
+        converted += 1
+      end
+      converted
+    end
+
+    # Returns counts of <code>:hits</code> and <code>:misses</code>
+    # in this process.
+    #
+    # @return [Hash]
+    def stats
+      @mutex.synchronize { {:hits => @hits, :misses => @misses} }
+    end
+
+    # Removes all cached files.
+    def clear
+      Dir.glob(File.join(@dir, '??', '*')).each do |path|
+        begin
+          File.unlink(path)
+        rescue Errno::ENOENT
+        end
+      end
+      self
+    end
+
+    # @private
+    def inspect
+      "#<#{self.class}: #{@dir}>"
+    end
+
+    private
+
+    def path_for(voice, text, audio_type, opts)
+      opts = Cache.output_options(opts)
+      opts = opts ? opts.sort_by { |k, v| k.to_s } : []
+      key = Marshal.dump([FORMAT_VERSION, Flite::CMU_FLITE_VERSION,
+                          voice.name, voice.pathname, text.to_s,
+                          (audio_type || :wav).to_s, opts.inspect])
+      digest = Digest::SHA256.hexdigest(key)
+      File.join(@dir, digest[0, 2], "#{digest[2..-1]}.#{audio_type || :wav}")
+    end
+
+    def store(path, data)
+      FileUtils.mkdir_p(File.dirname(path))
+      tmp = "#{path}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+      begin
+        File.binwrite(tmp, data)
+        # rename(2) is atomic. Readers in other processes see
+        # the old file, no file or the complete new file.
+        File.rename(tmp, path)
+      rescue SystemCallError
+        File.unlink(tmp) rescue nil
+      end
+    end
+  end
+end
@@ -0,0 +1,151 @@
+#
+# ruby-flite  -  a small speech synthesis library
+#   https://github.com/kubo/ruby-flite
+#
+# Copyright (C) 2015 Kubo Takehiro <kubo@jiubao.org>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#    1. Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#    2. Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials provided
+#       with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHORS ''AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+# BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+# OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+# IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# The views and conclusions contained in the software and documentation
+# are those of the authors and should not be interpreted as representing
+# official policies, either expressed or implied, of the authors.
+
+
+require 'thread'
+require 'etc'
+
+module Flite
+  # Converts <code>texts</code> to audio data using multiple CPU cores.
+  #
+  # Texts are distributed to worker threads, each of which has its own
+  # {Flite::Voice}. As speech synthesis runs without the GVL, workers
+  # run in parallel. Each worker takes texts from its own queue and
+  # steals texts from the tail of the busiest queue when its queue
+  # becomes empty, so a few long texts don't leave other workers idle.
+  #
+  # @example
+  #   texts = File.readlines('prompts.txt').map(&:chomp)
+  #   Flite.synthesize_all(texts, :voice => 'slt', :type => :mp3, :threads => 8).each_with_index do |data, idx|
+  #     File.binwrite("prompt#{idx}.mp3", data)
+  #   end
+  #
+  # @param [Array<String>] texts
+  # @param [Hash] opts
+  # @option opts [String] :voice voice name passed to {Flite::Voice#initialize}.
+  #   The default is the default voice of {Flite::Voice#initialize}.
+  # @option opts [Symbol] :type audio type. The default is :wav.
+  # @option opts [Integer] :threads number of worker threads.
+  #   The default is the number of CPUs.
+  # Other options are passed to {Flite::Voice#to_speech} as audio encoder options.
+  # @return [Array<String>] audio data in the order of <code>texts</code>
+  def self.synthesize_all(texts, opts = {})
+    opts = opts.dup
+    voice_name = opts.delete(:voice)
+    audio_type = opts.delete(:type) || :wav
+    num_threads = opts.delete(:threads) || VoicePool.default_size
+    encoder_opts = opts.empty? ? nil : opts
+    texts = texts.to_a
+    num_threads = [[num_threads, texts.size].min, 1].max
+    results = Array.new(texts.size)
+
+    # Split indexes of texts into contiguous ranges, one for each worker.
+    queues = Array.new(num_threads) do |i|
+      first = texts.size * i / num_threads
+      last = texts.size * (i + 1) / num_threads
+      WorkQueue.new((first...last).to_a)
+    end
+    aborted = false
+
+    workers = Array.new(num_threads) do |i|
+      Thread.new(queues[i]) do |queue|
+        # The exception is raised in the caller by Thread#join.
+        Thread.current.report_on_exception = false if Thread.current.respond_to?(:report_on_exception=)
+        voice = Flite::Voice.new(voice_name)
+        begin
+          while !aborted && (idx = queue.shift || steal(queues))
+            results[idx] = voice.to_speech(texts[idx], audio_type, encoder_opts)
+          end
+        rescue Exception
+          aborted = true
+          raise
+        end
+      end
+    end
+    error = nil
+    begin
+      workers.each do |t|
+        begin
+          t.join
+        rescue Exception => e
+          # stop the other workers and re-raise the first error after they finish.
+          aborted = true
+          error ||= e
+        end
+      end
+    ensure
+      # The caller may be interrupted while joining. Don't leave workers synthesizing.
+      aborted = true
+      workers.each do |t|
+        begin
+          t.join
+        rescue Exception
+        end
+      end
+    end
+    raise error if error
+    results
+  end
+
+  # @private
+  def self.steal(queues)
+    loop do
+      victim = queues.max_by(&:size)
+      return nil if victim.size == 0
+      idx = victim.pop
+      return idx if idx
+    end
+  end
+
+  # @private
+  class WorkQueue
+    def initialize(items)
+      @items = items
+      @mutex = Mutex.new
+    end
+
+    # taken by the owner
+    def shift
+      @mutex.synchronize { @items.shift }
+    end
+
+    # stolen by other workers
+    def pop
+      @mutex.synchronize { @items.pop }
+    end
+
+    def size
+      @items.size
+    end
+  end
+end
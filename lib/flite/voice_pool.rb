@@ -0,0 +1,172 @@
+#
+# ruby-flite  -  a small speech synthesis library
+#   https://github.com/kubo/ruby-flite
+#
+# Copyright (C) 2015 Kubo Takehiro <kubo@jiubao.org>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#    1. Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#    2. Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials provided
+#       with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHORS ''AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> OR CONTRIBUTORS BE
+# LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+# CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+# SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+# BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+# OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+# IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+# The views and conclusions contained in the software and documentation
+# are those of the authors and should not be interpreted as representing
+# official policies, either expressed or implied, of the authors.
+
+require 'thread'
+require 'etc'
+
+module Flite
+  # A fixed-size set of independent voices sharing one voice name.
+  #
+  # A {Flite::Voice} serializes threads using it, so only one speech
+  # per voice is synthesized at a time. A voice pool holds several
+  # voices and hands out an idle one per call. As speech synthesis
+  # runs without the GVL, threads using the pool are synthesized
+  # on multiple CPU cores in parallel.
+  #
+  # @example
+  #   pool = Flite::VoicePool.new('slt', :size => 8)
+  #
+  #   # Called from many threads
+  #   data = pool.to_speech('Hello Flite World!', :mp3)
+  #
+  #   # Fail fast when all voices are busy.
+  #   pool = Flite::VoicePool.new('slt', :size => 8, :timeout => 0)
+  #   begin
+  #     data = pool.to_speech('Hello Flite World!')
+  #   rescue Flite::BusyError
+  #     ...
+  #   end
+  class VoicePool
+    # @return [Integer] number of voices in the pool
+    attr_reader :size
+
+    # @return [Float, nil] seconds to wait for an idle voice
+    attr_accessor :timeout
+
+    # Creates a new voice pool.
+    #
+    # @param [String] name voice name passed to {Flite::Voice#initialize}
+    # @param [Hash] opts
+    # @option opts [Integer] :size number of voices. The default is
+    #   the number of CPUs when it is available. Otherwise 1.
+    # @option opts [Float] :timeout seconds to wait for an idle voice.
+    #   When it is nil, wait forever. When it is 0, raise {Flite::BusyError}
+    #   immediately if all voices are busy. The default is nil.
+    def initialize(name = nil, opts = {})
+      @size = opts[:size] || VoicePool.default_size
+      if @size <= 0
+        raise ArgumentError, "invalid pool size #{@size}. It must be positive number."
+      end
+      @timeout = opts[:timeout]
+      @idle_voices = Array.new(@size) { Flite::Voice.new(name) }
+      @voice_name = @idle_voices.first.name
+      @mutex = Mutex.new
+      @cond = ConditionVariable.new
+    end
+
+    # Returns the number of idle voices.
+    #
+    # @return [Integer]
+    def available
+      @mutex.synchronize { @idle_voices.size }
+    end
+
+    # Checks out an idle voice, yields it and returns it to the pool.
+    #
+    # @yieldparam [Flite::Voice] voice
+    # @return the value of the block
+    # @raise [Flite::BusyError] when no voice becomes idle within {#timeout}
+    def with_voice
+      voice = checkout
+      begin
+        yield voice
+      ensure
+        checkin(voice)
+      end
+    end
+
+    # Speaks the <code>text</code> with an idle voice.
+    #
+    # @param [String] text
+    # @see Flite::Voice#speak
+    def speak(text)
+      with_voice { |voice| voice.speak(text) }
+      self
+    end
+
+    # Converts <code>text</code> to audio data with an idle voice.
+    # When a block is given, chunks of audio data are passed to it
+    # as {Flite::Voice#to_speech} does and the voice is kept until
+    # the block returns for the last chunk.
+    #
+    # @param [String] text
+    # @yieldparam [String] chunk audio data
+    # @return [String] audio data, or self when a block is given
+    # @see Flite::Voice#to_speech
+    def to_speech(text, *args, &block)
+      data = with_voice { |voice| voice.to_speech(text, *args, &block) }
+      block ? self : data
+    end
+
+    # @private
+    def inspect
+      "#<#{self.class}: #{@voice_name} (#{available}/#{@size} available)>"
+    end
+
+    # @private
+    def self.default_size
+      if Etc.respond_to?(:nprocessors)
+        Etc.nprocessors
+      else
+        1
+      end
+    end
+
+    private
+
+    def checkout
+      @mutex.synchronize do
+        if @idle_voices.empty?
+          if @timeout
+            deadline = Time.now + @timeout
+            while @idle_voices.empty?
+              rest = deadline - Time.now
+              raise Flite::BusyError, "all #{@size} voices are busy" if rest <= 0
+              @cond.wait(@mutex, rest)
+            end
+          else
+            @cond.wait(@mutex) while @idle_voices.empty?
+          end
+        end
+        @idle_voices.pop
+      end
+    end
+
+    def checkin(voice)
+      @mutex.synchronize do
+        @idle_voices.push(voice)
+        @cond.signal
+      end
+    end
+  end
+end